@@ -29,6 +29,29 @@
 // Undefine for debugging
 //#define DEBUG
 
+//  the group scans read whole 32 bit membership words worth of columns
+static_assert((LIFX_MAX_DEVICES % 32) == 0, "LIFX_MAX_DEVICES must be a multiple of 32");
+
+
+//  FNV-1a hash of a LIFX label field, used to skip string compares in the ByLabel functions
+static uint32_t lifx_label_hash(const char *label) {
+  uint32_t hash = 2166136261UL;
+  for (int i = 0; i < 32 && label[i] != 0; i++)
+  {
+    hash ^= (uint8_t) label[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+static bool lifx_id_valid(const byte id[LIFX_ID_LEN]) {
+  for (int i = 0; i < LIFX_ID_LEN; i++)
+  {
+    if (id[i] != 0) return true;
+  }
+  return false;
+}
+
 
 
 Lifx::Lifx()
@@ -38,6 +61,9 @@ Lifx::Lifx()
 
   //  Initialise payload
   memset(&_payload, 0, sizeof(_payload));
+
+  //  Initialise light state table
+  memset(&_lights, 0, sizeof(_lights));
   
   // Setup the static bits of header
   _header.tagged = 1;
@@ -53,7 +79,10 @@ Lifx::Lifx()
 void Lifx::begin() {
   //  UDP
   _udp.begin(LIFX_PORT);          // Listen for incoming UDP packets
-  
+
+  //  rediscovery counts from here, on a host millis() is uptime and the first loop() would broadcast
+  _discoveryTimer = Millis();
+
   //  random seed for source number
   #if defined(ESP8266)
   randomSeed(analogRead(0));
@@ -66,24 +95,52 @@ void Lifx::begin() {
 
 void Lifx::loop() {
   //  INCOMING UDP
+  #if defined(LIFX_HOST_UDP)
+  //  everything waiting, up to a batch, in one call
+  int count = _udp.ReceiveBatch(_rxBatch, LIFX_RX_BATCH_LEN);
+  if (count)
+  {
+    _transportStats.rxCalls++;
+    _transportStats.rxPackets += count;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    if (_rxBatch[i].len >= LIFX_INCOMING_PACKET_BUFFER_LEN) continue;
+    if (_recorder != NULL) _recorder->Record(LIFX_RECORD_RX, Millis(), _rxBatch[i].ipAddress, _rxBatch[i].data, _rxBatch[i].len);
+    ReceivedMessage(_rxBatch[i].data, _rxBatch[i].len, IPAddress(_rxBatch[i].ipAddress));
+  }
+  #else
   int packetLen = _udp.parsePacket();
   byte packetBuffer[LIFX_INCOMING_PACKET_BUFFER_LEN];
   if (packetLen && packetLen < LIFX_INCOMING_PACKET_BUFFER_LEN) 
   {
     _udp.read(packetBuffer, sizeof(packetBuffer));
-    ReceivedMessage(packetBuffer, packetLen);
+    _transportStats.rxCalls++;
+    _transportStats.rxPackets++;
+    if (_recorder != NULL) _recorder->Record(LIFX_RECORD_RX, Millis(), (uint32_t)_udp.remoteIP(), packetBuffer, packetLen);
+    ReceivedMessage(packetBuffer, packetLen, _udp.remoteIP());
   }
+  #endif
+
+  ServiceTimers();
+}
 
+void Lifx::ServiceTimers() {
+  //  the time driven part of loop(), without reading the socket
   if (_discoveryUnderway) DoDiscovery();
   
-  //  kick a discovery off every LIFX_REDISCOVERY_INTERVAL millisecs
-  if ((millis() - _discoveryTimer) > LIFX_REDISCOVERY_INTERVAL)
+  if (_healthMonitor && (Millis() - _healthTimer) >= LIFX_HEALTH_TICK) DoHealthMonitor();
+
+  //  kick a discovery off every LIFX_REDISCOVERY_INTERVAL millisecs (LIFX_HEALTH_REDISCOVERY_INTERVAL with the health monitor)
+  if ((Millis() - _discoveryTimer) > _rediscoveryInterval)
   {
     #ifdef DEBUG
     Serial.println("Rediscovery..");
     #endif
     StartDiscovery();
   }
+
+  DispatchEvents();
 }
 
 void Lifx::StartDiscovery() {
@@ -92,7 +149,8 @@ void Lifx::StartDiscovery() {
   Serial.println("Start discovery..");
   #endif
 
-  _discoveryTimer = millis();
+  _discoveryTimer = Millis();
+  if (_recorder != NULL) _recorder->Record(LIFX_RECORD_DISCOVERY, _discoveryTimer, 0, NULL, 0);
   _discoveryNextMsec = 3000;
   _discoveryBroadcastCount = 0;
   _discoveryDeviceIndex = 0;
@@ -102,7 +160,7 @@ void Lifx::StartDiscovery() {
 void Lifx::DoDiscovery() {
   //  i had trouble making this reliable. slowing it down helped. i had it arrivale of a response from a light kicking off the next
   //  get message and think that there was too much UDP traffic to keep up with
-  unsigned long msecs = millis() - _discoveryTimer;
+  unsigned long msecs = Millis() - _discoveryTimer;
   
   //  at milliseconds 0, 1000 and 2000 send out discovery broadcasts. do this three times because it seems like a dodgy process
   //  devices are recognised in ReceivedMessage
@@ -155,6 +213,10 @@ void Lifx::DoDiscovery() {
 }
 
 void Lifx::ReceivedMessage(byte packet[], int packetLen) {
+  ReceivedMessage(packet, packetLen, _udp.remoteIP());
+}
+
+void Lifx::ReceivedMessage(byte packet[], int packetLen, IPAddress ipAddress) {
   //  we get 'get service' messages from the phone app and should ignore these
   if (((lifx_header *)packet)->type == LIFX_DEVICE_GETSERVICE)
   {
@@ -164,18 +226,26 @@ void Lifx::ReceivedMessage(byte packet[], int packetLen) {
   }
   else
   {
-    Device *dev = DeviceAddToArray(((lifx_header *)packet)->target, (uint32_t)_udp.remoteIP());
+    Device *dev = DeviceAddToArray(((lifx_header *)packet)->target, ipAddress);
+    if (dev == NULL) return;    // device table is full
     
     #ifdef DEBUG
-    Serial.printf("Recd %s %d, msg type %d, source %d, MAC addr %s\n", _udp.remoteIP().toString().c_str(), _udp.remotePort(), ((lifx_header *)packet)->type, ((lifx_header *)packet)->source, dev->MacAddressString());
+    Serial.printf("Recd %s, msg type %d, source %d, MAC addr %s\n", ipAddress.toString().c_str(), ((lifx_header *)packet)->type, ((lifx_header *)packet)->source, dev->MacAddressString());
     #endif
   
+    DeviceSeen(dev, ((lifx_header *)packet)->type, packet + sizeof(lifx_header));
     DealWithReceivedMessage(packet, packetLen, dev);
+    DispatchEvents();
   }  
   return;
 }
 
 void Lifx::DealWithReceivedMessage(byte packet[], int packetLen, Device *device) {
+  byte *payload = packet + sizeof(lifx_header);
+
+  //  health probe replies are dealt with in DeviceSeen and must not disturb the discovery sequence
+  if (((lifx_header *)packet)->type == LIFX_DEVICE_ECHORESPONSE) return;
+
   device->LastMessageType = ((lifx_header *)packet)->type;
   
   switch (device->LastMessageType)
@@ -185,36 +255,228 @@ void Lifx::DealWithReceivedMessage(byte packet[], int packetLen, Device *device)
       break;
 
     case LIFX_DEVICE_STATEPOWER:
-      device->Power=((lifx_payload_device_power *)(packet + sizeof(lifx_header)))->level;
+      UpdatePower(device, ((lifx_payload_device_power *)payload)->level);
       break;
 
     case LIFX_DEVICE_STATELABEL:
-      memcpy(device->Label, ((lifx_payload_device_label *)(packet + sizeof(lifx_header)))->label, 32);
+      //  selectors and groups are only re-evaluated when the metadata actually changes
+      if (memcmp(device->Label, ((lifx_payload_device_label *)payload)->label, 32) != 0)
+      {
+        UpdateText(device, LIFX_CHANGE_LABEL, device->Label, ((lifx_payload_device_label *)payload)->label);
+        UpdateMembership(device);
+      }
       break;
       
     case LIFX_DEVICE_STATEVERSION:
-      device->Product=((lifx_payload_device_version *)(packet + sizeof(lifx_header)))->product;
+      if (device->Product != ((lifx_payload_device_version *)payload)->product)
+      {
+        device->Product=((lifx_payload_device_version *)payload)->product;
+        UpdateMembership(device);
+      }
       break;
 
     case LIFX_DEVICE_STATELOCATION:
-      memcpy(device->Location, ((lifx_payload_device_location *)(packet + sizeof(lifx_header)))->label, 32);
+      if ((memcmp(device->LocationId, ((lifx_payload_device_location *)payload)->location, LIFX_ID_LEN) != 0) ||
+          (memcmp(device->Location, ((lifx_payload_device_location *)payload)->label, 32) != 0))
+      {
+        memcpy(device->LocationId, ((lifx_payload_device_location *)payload)->location, LIFX_ID_LEN);
+        UpdateText(device, LIFX_CHANGE_LOCATION, device->Location, ((lifx_payload_device_location *)payload)->label);
+        UpdateMembership(device);
+      }
       break;
       
     case LIFX_DEVICE_STATEGROUP:
-      memcpy(device->Group, ((lifx_payload_device_group *)(packet + sizeof(lifx_header)))->label, 32);
+      UpdateGroup(device, (lifx_payload_device_group *)payload);
       break;
       
     case LIFX_LIGHT_STATE:
-      device->Hue = ((lifx_payload_light_state *)(packet + sizeof(lifx_header)))->hue;
-      device->Saturation = ((lifx_payload_light_state *)(packet + sizeof(lifx_header)))->saturation;
-      device->Brightness = ((lifx_payload_light_state *)(packet + sizeof(lifx_header)))->brightness;
-      device->Kelvin = ((lifx_payload_light_state *)(packet + sizeof(lifx_header)))->kelvin;
-      device->Power = ((lifx_payload_light_state *)(packet + sizeof(lifx_header)))->power;
+      UpdateColor(device, ((lifx_payload_light_state *)payload)->hue, ((lifx_payload_light_state *)payload)->saturation,
+                  ((lifx_payload_light_state *)payload)->brightness, ((lifx_payload_light_state *)payload)->kelvin);
+      UpdatePower(device, ((lifx_payload_light_state *)payload)->power);
       _lightUpdateUnderway = 0;
       break;
   }
 }
 
+void Lifx::UpdatePower(Device *device, uint16_t power) {
+  //  the Update functions store a reported value and tell the change callback if it differs
+  lifx_device_change change;
+
+  if (device->Power == power) return;
+  memset(&change, 0, sizeof(lifx_device_change));
+  change.field = LIFX_CHANGE_POWER;
+  change.oldPower = device->Power;
+  change.newPower = power;
+  device->Power = power;
+  QueueEvent(LIFX_EVENT_CHANGE, device, &change);
+}
+
+void Lifx::UpdateColor(Device *device, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin) {
+  lifx_device_change change;
+
+  if (device->Hue == hue && device->Saturation == saturation && device->Brightness == brightness && device->Kelvin == kelvin) return;
+  memset(&change, 0, sizeof(lifx_device_change));
+  change.field = LIFX_CHANGE_COLOR;
+  change.oldColor = {device->Hue, device->Saturation, device->Brightness, device->Kelvin};
+  change.newColor = {hue, saturation, brightness, kelvin};
+  device->Hue = hue;
+  device->Saturation = saturation;
+  device->Brightness = brightness;
+  device->Kelvin = kelvin;
+  QueueEvent(LIFX_EVENT_CHANGE, device, &change);
+}
+
+void Lifx::UpdateText(Device *device, uint8_t field, char *text, const char *value) {
+  //  label, group and location, 32 bytes that need not be NUL terminated
+  lifx_device_change change;
+
+  if (memcmp(text, value, 32) == 0) return;
+  if (_deviceChangeFunction == NULL)
+  {
+    memcpy(text, value, 32);
+    return;
+  }
+  memset(&change, 0, sizeof(lifx_device_change));
+  change.field = field;
+  memcpy(change.oldText, text, 32);
+  change.oldText[32] = 0;
+  memcpy(change.newText, value, 32);
+  change.newText[32] = 0;
+  memcpy(text, value, 32);
+  QueueEvent(LIFX_EVENT_CHANGE, device, &change);
+}
+
+void Lifx::QueueEvent(uint8_t event, Device *device, const lifx_device_change *change) {
+  //  callbacks are held until DispatchEvents so they never run while the device table, group membership or
+  //  health bookkeeping is part way through an update
+  if (event == LIFX_EVENT_CHANGE && _deviceChangeFunction == NULL) return;
+  if (event == LIFX_EVENT_ADDED && _deviceAddedFunction == NULL) return;
+  if (event == LIFX_EVENT_REMOVED && _deviceRemovedFunction == NULL) return;
+
+  _events.push_back(lifx_device_event());
+  _events.back().event = event;
+  _events.back().device = device;
+  if (change != NULL) _events.back().change = *change;
+}
+
+void Lifx::DispatchEvents() {
+  //  called once a received message or timer tick is fully dealt with. callbacks may call back into Lifx, and
+  //  any events that raises are dispatched in turn
+  while (_eventHead < _events.size())
+  {
+    lifx_device_event e = _events[_eventHead++];
+    switch (e.event)
+    {
+      case LIFX_EVENT_CHANGE:
+        if (_deviceChangeFunction != NULL) _deviceChangeFunction (*this, e.device, e.change);
+        break;
+
+      case LIFX_EVENT_ADDED:
+        if (_deviceAddedFunction != NULL) _deviceAddedFunction (*this, e.device);
+        break;
+
+      case LIFX_EVENT_REMOVED:
+        if (_deviceRemovedFunction != NULL) _deviceRemovedFunction (*this, e.device);
+        break;
+    }
+  }
+  _events.clear();
+  _eventHead = 0;
+}
+
+void Lifx::UpdateGroup(Device *device, lifx_payload_device_group *group) {
+  //  a group is named by the report with the newest updated_at, so one bulb with a stale name can't rename
+  //  it. every member's Group follows the group's name so the ByGroup methods and group selectors agree.
+  //  a report with no UUID keeps its own label, UpdateMembership groups those devices by label
+  const char *label = group->label;
+  int g;
+
+  if (lifx_id_valid(group->group))
+  {
+    for (g = 0; g < (int) _groups.size(); g++)
+    {
+      if (memcmp(_groups[g].id, group->group, LIFX_ID_LEN) == 0) break;
+    }
+    if (g == (int) _groups.size())
+    {
+      _groups.push_back(lifx_group());
+      memcpy(_groups[g].id, group->group, LIFX_ID_LEN);
+      memcpy(_groups[g].label, group->label, 32);
+      _groups[g].updatedAt = group->updated_at;
+    }
+    else if (group->updated_at > _groups[g].updatedAt)
+    {
+      _groups[g].updatedAt = group->updated_at;
+      if (memcmp(_groups[g].label, group->label, 32) != 0)
+      {
+        memcpy(_groups[g].label, group->label, 32);
+        for (int i = _groups[g].members.Next(0); i >= 0; i = _groups[g].members.Next(i + 1))
+        {
+          if (_devices[i] == device) continue;
+          UpdateText(_devices[i], LIFX_CHANGE_GROUP, _devices[i]->Group, _groups[g].label);
+          UpdateMembership(_devices[i]);
+        }
+      }
+    }
+    label = _groups[g].label;
+  }
+
+  //  selectors and groups are only re-evaluated when the device's group actually changes
+  if ((memcmp(device->GroupId, group->group, LIFX_ID_LEN) != 0) || (memcmp(device->Group, label, 32) != 0))
+  {
+    memcpy(device->GroupId, group->group, LIFX_ID_LEN);
+    UpdateText(device, LIFX_CHANGE_GROUP, device->Group, label);
+    UpdateMembership(device);
+  }
+}
+
+void Lifx::UpdateMembership(Device *device) {
+  uint16_t n = device->Index();
+  bool keyed = lifx_id_valid(device->GroupId);
+  bool found = false;
+
+  device->LabelHash = lifx_label_hash(device->Label);
+
+  //  move the device to the group with its current UUID. UpdateGroup keeps the group's name. a device
+  //  without a group UUID goes in a group with no UUID and the same label so ByGroup still reaches it
+  for (lifx_group &g: _groups)
+  {
+    bool match = keyed ? (memcmp(g.id, device->GroupId, LIFX_ID_LEN) == 0)
+                       : (!lifx_id_valid(g.id) && device->Group[0] != 0 && strncmp(g.label, device->Group, 32) == 0);
+    if (match)
+    {
+      g.members.Set(n);
+      found = true;
+    }
+    else
+    {
+      g.members.Clear(n);
+    }
+  }
+  if (!found && (keyed || device->Group[0] != 0))
+  {
+    _groups.push_back(lifx_group());
+    memcpy(_groups.back().id, device->GroupId, LIFX_ID_LEN);
+    memcpy(_groups.back().label, device->Group, 32);
+    _groups.back().members.Set(n);
+  }
+
+  for (lifx_compiled_selector &s: _selectors)
+  {
+    if (s.inUse) s.members.Assign(n, s.selector.Matches(device));
+  }
+}
+
+int Lifx::FindGroup(const char *label, int start) {
+  //  returns the index of the next group at or after start with a matching label, -1 if there are no more
+  for (int g = start; g < (int) _groups.size(); g++)
+  {
+    if (strncmp(_groups[g].label, label, 32) == 0)
+      return g;
+  }
+  return -1;
+}
+
 void Lifx::SendMessage(uint16_t messageType, byte *macAddress, IPAddress ipAddress, int payloadLen) {  
   _header.size = sizeof(lifx_header) + payloadLen;
   _header.source = random(4294967295);
@@ -230,12 +492,18 @@ void Lifx::SendMessage(uint16_t messageType, byte *macAddress, IPAddress ipAddre
     _header.tagged = 0;
   }
     
-  // Send the packet
-  _udp.beginPacket(ipAddress, LIFX_PORT);
-  _udp.write((const uint8_t *) &_header, sizeof(lifx_header));
+  //  assemble the datagram in the outbound batch, it goes out now unless a batch is open
+  lifx_tx_packet *packet = &_txBatch[_txCount++];
+  packet->ipAddress = (uint32_t)ipAddress;
+  packet->len = sizeof(lifx_header) + payloadLen;
+  memcpy(packet->data, &_header, sizeof(lifx_header));
   if (payloadLen)
-    _udp.write((const uint8_t *) &_payload, payloadLen);
-  _udp.endPacket();
+    memcpy(packet->data + sizeof(lifx_header), &_payload, payloadLen);
+
+  if (_recorder != NULL)
+    _recorder->Record(LIFX_RECORD_TX, Millis(), (uint32_t)ipAddress, packet->data, packet->len);
+
+  if (_txBatchDepth == 0 || _txCount == LIFX_TX_BATCH_LEN) FlushBatch();
 
   #ifdef DEBUG
   if (macAddress) 
@@ -245,17 +513,84 @@ void Lifx::SendMessage(uint16_t messageType, byte *macAddress, IPAddress ipAddre
   #endif
 }
 
+void Lifx::BeginBatch() {
+  //  holds outgoing messages until the matching EndBatch (or the batch fills) so they go to the transport
+  //  together. batches nest
+  _txBatchDepth++;
+}
+
+void Lifx::EndBatch() {
+  if (_txBatchDepth > 0 && --_txBatchDepth == 0) FlushBatch();
+}
+
+void Lifx::FlushBatch() {
+  //  with transmit disabled the calls are estimated (one sendmmsg per batch) so a replay reports what it
+  //  would have cost. datagrams the transport couldn't send are counted in txDropped
+  if (_txCount == 0) return;
+  _transportStats.txPackets += _txCount;
+
+  #if defined(LIFX_HOST_UDP)
+  int calls = 1;
+  int sent = _txCount;
+  if (_transmitEnabled) sent = _udp.SendBatch(_txBatch, _txCount, LIFX_PORT, &calls);
+  _transportStats.txCalls += calls;
+  _transportStats.txDropped += _txCount - sent;
+  #else
+  for (int i = 0; i < _txCount; i++)
+  {
+    if (_transmitEnabled)
+    {
+      if (_udp.beginPacket(IPAddress(_txBatch[i].ipAddress), LIFX_PORT))
+      {
+        _udp.write(_txBatch[i].data, _txBatch[i].len);
+        if (!_udp.endPacket()) _transportStats.txDropped++;
+      }
+      else
+      {
+        _transportStats.txDropped++;
+      }
+    }
+    _transportStats.txCalls++;
+  }
+  #endif
+
+  _txCount = 0;
+}
+
+void Lifx::GetTransportStats(lifx_transport_stats *stats) {
+  *stats = _transportStats;
+}
+
 Device* Lifx::DeviceAddToArray(byte macAddress[6], IPAddress ipAddress) {
-  //  check if we already have this one
+  //  check if we already have this one, it may have a new address
   std::vector <Device*> :: iterator it;
   for(it = _devices.begin(); it != _devices.end(); ++it)
   {
     if (memcmp(macAddress, (*it)->MacAddress(), 6) == 0)
-        return *it;
+    {
+      if ((*it)->_ipAddress != (uint32_t)ipAddress)
+      {
+        lifx_device_change change;
+        memset(&change, 0, sizeof(lifx_device_change));
+        change.field = LIFX_CHANGE_IP_ADDRESS;
+        change.oldIpAddress = (*it)->_ipAddress;
+        change.newIpAddress = (uint32_t)ipAddress;
+        (*it)->_ipAddress = (uint32_t)ipAddress;
+        QueueEvent(LIFX_EVENT_CHANGE, *it, &change);
+      }
+      return *it;
+    }
   } 
-  //  if not add it to the vector
-  Device* dev = new Device(macAddress, (uint32_t)ipAddress);
+  //  if not add it to the vector, as long as there is room in the light table
+  if (_devices.size() >= LIFX_MAX_DEVICES) return NULL;
+  Device* dev = new Device(macAddress, (uint32_t)ipAddress, _devices.size(), _lights);
   _devices.push_back(dev);
+  _health.push_back(lifx_device_health());
+  _health.back().state = LIFX_HEALTH_ONLINE;
+  _health.back().interval = LIFX_HEALTH_FAST_INTERVAL;
+  _health.back().lastActivity = Millis();
+  UpdateMembership(dev);
+  QueueEvent(LIFX_EVENT_ADDED, dev, NULL);
   return dev;
 }
 
@@ -296,63 +631,79 @@ void Lifx::SetDeviceColor(Device *dev, uint16_t hue, uint16_t saturation, uint16
   SendMessage(LIFX_LIGHT_SETCOLOR, dev->MacAddress(), IPAddress(dev->IpAddress()), sizeof(lifx_payload_light_setcolor));
 }
 
+void Lifx::SetDeviceColor(Device *dev, const lifx_hsbk &hsbk, uint32_t duration) {
+  SetDeviceColor(dev, hsbk.hue, hsbk.saturation, hsbk.brightness, hsbk.kelvin, duration);
+}
+
 void Lifx::SetBrightnessByLabel(char *label, uint16_t brightness, uint32_t duration) {
+  uint32_t hash = lifx_label_hash(label);
+  BeginBatch();
   for(Device *dev: _devices)
   {
-    if (strcmp(dev->Label,label) == 0)
+    if (dev->LabelHash == hash && strncmp(dev->Label, label, 32) == 0 && !_offline.Test(dev->Index()))
     {
       SetDeviceBrightness(dev, brightness, duration);
     }
   }
+  EndBatch();
 }
 
 void Lifx::SetBrightnessByGroup(char *group, uint16_t brightness, uint32_t duration) {
-  for(Device *dev: _devices)
+  BeginBatch();
+  for (int g = FindGroup(group, 0); g >= 0; g = FindGroup(group, g + 1))
   {
-    if (strcmp(dev->Group, group) == 0)
+    for (int i = _groups[g].members.Next(0, &_offline); i >= 0; i = _groups[g].members.Next(i + 1, &_offline))
     {
-      SetDeviceBrightness(dev, brightness, duration);
+      SetDeviceBrightness(_devices[i], brightness, duration);
     }
   }
+  EndBatch();
 }
 
 void Lifx::SetColorByGroup(char *group, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration) {
-  for(Device *dev: _devices)
+  BeginBatch();
+  for (int g = FindGroup(group, 0); g >= 0; g = FindGroup(group, g + 1))
   {
-    if (strcmp(dev->Group, group) == 0)
+    for (int i = _groups[g].members.Next(0, &_offline); i >= 0; i = _groups[g].members.Next(i + 1, &_offline))
     {
-      SetDeviceColor(dev, hue, saturation, brightness, kelvin, duration);
+      SetDeviceColor(_devices[i], hue, saturation, brightness, kelvin, duration);
     }
   }
+  EndBatch();
 }
 
 void Lifx::SetColorByLabel(char *label, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration) {
+  uint32_t hash = lifx_label_hash(label);
+  BeginBatch();
   for(Device *dev: _devices)
   {
-    if (strcmp(dev->Label,label) == 0)
+    if (dev->LabelHash == hash && strncmp(dev->Label, label, 32) == 0 && !_offline.Test(dev->Index()))
     {
       SetDeviceColor(dev, hue, saturation, brightness, kelvin, duration);
     }
   }
+  EndBatch();
 }
 
 void Lifx::SetPowerByGroup(char *group, uint16_t power) {
-  _payload.power.level = power;
-  for(Device *dev: _devices)
+  BeginBatch();
+  for (int g = FindGroup(group, 0); g >= 0; g = FindGroup(group, g + 1))
   {
-    if (strcmp(dev->Group,group) == 0)
-      SetDevicePower(dev, power);
+    for (int i = _groups[g].members.Next(0, &_offline); i >= 0; i = _groups[g].members.Next(i + 1, &_offline))
+      SetDevicePower(_devices[i], power);
   }
+  EndBatch();
 }
 
 void Lifx::SetPowerByLabel(char *label, uint16_t power) {
-  _payload.power.level = power;
+  uint32_t hash = lifx_label_hash(label);
+  BeginBatch();
   for(Device *dev: _devices)
   {
-    if (strcmp(dev->Label,label) == 0)
-      //SendMessage(LIFX_DEVICE_SETPOWER, dev->MacAddress(), IPAddress(dev->IpAddress()), sizeof(lifx_payload_device_power));
+    if (dev->LabelHash == hash && strncmp(dev->Label, label, 32) == 0 && !_offline.Test(dev->Index()))
       SetDevicePower(dev, power);
   }
+  EndBatch();
 }
 
 void Lifx::StartDeviceLightUpdate(Device *dev) {
@@ -365,49 +716,365 @@ bool Lifx::DeviceLightUpdateDone() {
 }
 
 uint16_t Lifx::StatePowerByGroup(char *group) {
-  //  returns the power of the first device found in the group
-  for(Device *dev: _devices)
+  //  returns the power of the first online device found in the group
+  for (int g = FindGroup(group, 0); g >= 0; g = FindGroup(group, g + 1))
   {
-    if (strcmp(dev->Group,group) == 0)
-      return dev->Power;
+    int i = _groups[g].members.Next(0, &_offline);
+    if (i >= 0)
+      return _devices[i]->Power;
   }
   return 0;
 }
 
 uint16_t Lifx::StatePowerByLabel(char *label) {
   //  returns the power of the device with matching label
+  uint32_t hash = lifx_label_hash(label);
   for(Device *dev: _devices)
   {
-    if (strcmp(dev->Label,label) == 0)
+    if (dev->LabelHash == hash && strncmp(dev->Label, label, 32) == 0 && !_offline.Test(dev->Index()))
       return dev->Power;
   }
   return 0;
 }
 
 uint16_t Lifx::StateBrightnessByGroup(char *group) {
-  //  returns the brightness of the first device found in the group
-  for(Device *dev: _devices)
+  //  returns the brightness of the first online device found in the group
+  for (int g = FindGroup(group, 0); g >= 0; g = FindGroup(group, g + 1))
   {
-    if (strcmp(dev->Group,group) == 0)
-      return dev->Brightness;
+    int i = _groups[g].members.Next(0, &_offline);
+    if (i >= 0)
+      return _devices[i]->Brightness;
   }
   return 0;
 }
 
 uint16_t Lifx::StateBrightnessByLabel(char *label) {
   //  returns the brightness of the first device found in the group
+  uint32_t hash = lifx_label_hash(label);
   for(Device *dev: _devices)
   {
-    if (strcmp(dev->Label,label) == 0)
+    if (dev->LabelHash == hash && strncmp(dev->Label, label, 32) == 0 && !_offline.Test(dev->Index()))
       return dev->Brightness;
   }
   return 0;
 }
 
+int Lifx::CompileSelector(const LifxSelector &selector) {
+  //  returns a handle for use with the BySelector functions. membership is evaluated once here and then
+  //  refreshed per device only when its label, group, location or product changes
+  int handle;
+  for (handle = 0; handle < (int) _selectors.size(); handle++)
+  {
+    if (!_selectors[handle].inUse) break;
+  }
+  if (handle == (int) _selectors.size()) _selectors.push_back(lifx_compiled_selector());
+
+  _selectors[handle].selector = selector;
+  _selectors[handle].members.ClearAll();
+  _selectors[handle].inUse = true;
+  for(Device *dev: _devices)
+  {
+    if (selector.Matches(dev)) _selectors[handle].members.Set(dev->Index());
+  }
+  return handle;
+}
+
+void Lifx::ReleaseSelector(int handle) {
+  LifxDeviceSet *set = SelectorSet(handle);
+  if (set != NULL)
+  {
+    set->ClearAll();
+    _selectors[handle].inUse = false;
+  }
+}
+
+LifxDeviceSet *Lifx::SelectorSet(int handle) {
+  if (handle < 0 || handle >= (int) _selectors.size() || !_selectors[handle].inUse) return NULL;
+  return &_selectors[handle].members;
+}
+
+const LifxDeviceSet *Lifx::SelectorDevices(int handle) {
+  return SelectorSet(handle);
+}
+
+void Lifx::SetBrightnessBySelector(int handle, uint16_t brightness, uint32_t duration) {
+  LifxDeviceSet *set = SelectorSet(handle);
+  if (set == NULL) return;
+  BeginBatch();
+  for (int i = set->Next(0, &_offline); i >= 0; i = set->Next(i + 1, &_offline))
+    SetDeviceBrightness(_devices[i], brightness, duration);
+  EndBatch();
+}
+
+void Lifx::SetColorBySelector(int handle, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration) {
+  LifxDeviceSet *set = SelectorSet(handle);
+  if (set == NULL) return;
+  BeginBatch();
+  for (int i = set->Next(0, &_offline); i >= 0; i = set->Next(i + 1, &_offline))
+    SetDeviceColor(_devices[i], hue, saturation, brightness, kelvin, duration);
+  EndBatch();
+}
+
+void Lifx::SetPowerBySelector(int handle, uint16_t power) {
+  LifxDeviceSet *set = SelectorSet(handle);
+  if (set == NULL) return;
+  BeginBatch();
+  for (int i = set->Next(0, &_offline); i >= 0; i = set->Next(i + 1, &_offline))
+    SetDevicePower(_devices[i], power);
+  EndBatch();
+}
+
+uint16_t Lifx::StateBrightnessBySelector(int handle) {
+  //  returns the brightness of the first online selected device
+  LifxDeviceSet *set = SelectorSet(handle);
+  int i = (set != NULL) ? set->Next(0, &_offline) : -1;
+  return (i >= 0) ? _devices[i]->Brightness : 0;
+}
+
+uint16_t Lifx::StatePowerBySelector(int handle) {
+  //  returns the power of the first online selected device
+  LifxDeviceSet *set = SelectorSet(handle);
+  int i = (set != NULL) ? set->Next(0, &_offline) : -1;
+  return (i >= 0) ? _devices[i]->Power : 0;
+}
+
+void Lifx::AccumulateState(const LifxDeviceSet &set, lifx_group_state *state, uint32_t *brightnessSum) {
+  //  walk the membership a word at a time, leaving out offline devices. each word is expanded to a
+  //  0/0xFFFF mask per slot first so the column reductions are fixed width with no per-slot shift
+  //  or branch. GCC vectorizes the reduction loop at -O2 and above on targets with SIMD
+  uint16_t mask[32];
+  uint16_t on = 0;
+  uint16_t count = 0;
+  uint16_t minBrightness = state->minBrightness;
+  uint16_t maxBrightness = state->maxBrightness;
+  uint32_t sum = 0;
+
+  for (uint16_t w = 0; w < set.Words(); w++)
+  {
+    uint32_t bits = set.Word(w) & ~_offline.Word(w);
+    if (bits == 0) continue;
+
+    for (int j = 0; j < 32; j++, bits >>= 1)
+      mask[j] = -(uint16_t) (bits & 1);
+
+    const uint16_t *power = &_lights.power[w << 5];
+    const uint16_t *brightness = &_lights.brightness[w << 5];
+    for (int j = 0; j < 32; j++)
+    {
+      uint16_t m = mask[j];
+      uint16_t b = brightness[j] & m;
+      uint16_t bMin = brightness[j] | (uint16_t) ~m;
+      count += m & 1;
+      on += m & (power[j] != 0);
+      sum += b;
+      minBrightness = (bMin < minBrightness) ? bMin : minBrightness;
+      maxBrightness = (b > maxBrightness) ? b : maxBrightness;
+    }
+  }
+
+  state->count += count;
+  state->on += on;
+  state->off += count - on;
+  state->minBrightness = minBrightness;
+  state->maxBrightness = maxBrightness;
+  *brightnessSum += sum;
+}
+
+void Lifx::StateByGroup(char *group, lifx_group_state *state) {
+  //  aggregates every group with a matching name
+  uint32_t sum = 0;
+
+  memset(state, 0, sizeof(lifx_group_state));
+  state->minBrightness = 0xFFFF;
+  for (int g = FindGroup(group, 0); g >= 0; g = FindGroup(group, g + 1))
+    AccumulateState(_groups[g].members, state, &sum);
+
+  if (state->count == 0) state->minBrightness = 0;
+  else state->meanBrightness = sum / state->count;
+}
+
+void Lifx::StateBySelector(int handle, lifx_group_state *state) {
+  LifxDeviceSet *set = SelectorSet(handle);
+  uint32_t sum = 0;
+
+  memset(state, 0, sizeof(lifx_group_state));
+  state->minBrightness = 0xFFFF;
+  if (set != NULL) AccumulateState(*set, state, &sum);
+
+  if (state->count == 0) state->minBrightness = 0;
+  else state->meanBrightness = sum / state->count;
+}
+
+bool Lifx::StateAnyOnByGroup(char *group) {
+  lifx_group_state state;
+  StateByGroup(group, &state);
+  return state.on != 0;
+}
+
+bool Lifx::StateAllOnByGroup(char *group) {
+  lifx_group_state state;
+  StateByGroup(group, &state);
+  return (state.count != 0) && (state.off == 0);
+}
+
 void Lifx::DiscoveryCompleteCallback(CallbackFunction f) {
   _discoveryCompleteFunction = f;
 }
 
+void Lifx::DeviceChangeCallback(DeviceChangeFunction f) {
+  //  called when a device reports a power, color, label, group or location different from the device table,
+  //  and when it replies from a new address. callbacks run after the device table, groups and selectors are
+  //  brought up to date, never part way through
+  _deviceChangeFunction = f;
+}
+
+void Lifx::DeviceAddedCallback(DeviceFunction f) {
+  //  called when a new device is first heard from, and when an offline device is heard from again
+  _deviceAddedFunction = f;
+}
+
+void Lifx::DeviceRemovedCallback(DeviceFunction f) {
+  //  called when the health monitor marks a device offline. the Device stays in the table
+  _deviceRemovedFunction = f;
+}
+
+void Lifx::EnableHealthMonitor(bool enable) {
+  //  probes each device with a unicast EchoRequest, often while it is new, slow or missing replies and
+  //  backing off while it answers promptly. offline devices are left out of group, label and selector
+  //  commands and queries, and full rediscovery drops to LIFX_HEALTH_REDISCOVERY_INTERVAL
+  _healthMonitor = enable;
+  _rediscoveryInterval = enable ? LIFX_HEALTH_REDISCOVERY_INTERVAL : LIFX_REDISCOVERY_INTERVAL;
+  //  disabling it brings offline devices back, each with an added callback
+  if (!enable)
+  {
+    for (lifx_device_health &h: _health)
+    {
+      h.state = LIFX_HEALTH_ONLINE;
+      h.missed = 0;
+      h.probing = false;
+    }
+    for (int i = _offline.Next(0); i >= 0; i = _offline.Next(i + 1))
+      QueueEvent(LIFX_EVENT_ADDED, _devices[i], NULL);
+    _offline.ClearAll();
+    DispatchEvents();
+  }
+}
+
+const lifx_device_health *Lifx::DeviceHealth(Device *dev) {
+  return &_health[dev->Index()];
+}
+
+const LifxDeviceSet *Lifx::OfflineDevices() {
+  return &_offline;
+}
+
+void Lifx::DoHealthMonitor() {
+  unsigned long now = Millis();
+  int probes = 0;
+
+  _healthTimer = now;
+  for (uint16_t i = 0; i < _health.size(); i++)
+  {
+    lifx_device_health &h = _health[i];
+
+    if (h.probing)
+    {
+      if ((now - h.probeSent) <= LIFX_HEALTH_PROBE_TIMEOUT) continue;
+
+      //  missed, probe again soon unless it is now offline
+      h.probing = false;
+      h.lastActivity = now;
+      if (h.missed < 255) h.missed++;
+      if (h.missed >= LIFX_HEALTH_OFFLINE_MISSES)
+      {
+        h.interval = LIFX_HEALTH_SLOW_INTERVAL;
+        if (h.state != LIFX_HEALTH_OFFLINE)
+        {
+          #ifdef DEBUG
+          Serial.printf("%s offline\n", _devices[i]->MacAddressString());
+          #endif
+          h.state = LIFX_HEALTH_OFFLINE;
+          _offline.Set(i);
+          QueueEvent(LIFX_EVENT_REMOVED, _devices[i], NULL);
+
+          //  it may have moved address, look for it
+          if (!_discoveryUnderway && (now - _discoveryTimer) > LIFX_HEALTH_MIN_REDISCOVERY) StartDiscovery();
+        }
+      }
+      else
+      {
+        h.state = LIFX_HEALTH_DEGRADED;
+        h.interval = LIFX_HEALTH_FAST_INTERVAL;
+      }
+    }
+    else if ((now - h.lastActivity) >= h.interval && probes < LIFX_HEALTH_PROBES_PER_TICK)
+    {
+      SendProbe(_devices[i]);
+      probes++;
+    }
+  }
+}
+
+void Lifx::SendProbe(Device *device) {
+  lifx_device_health &h = _health[device->Index()];
+
+  h.probing = true;
+  h.probeSent = Millis();
+  memset(_payload.echo.echoing, 0, sizeof(_payload.echo.echoing));
+  memcpy(_payload.echo.echoing, &h.probeSent, sizeof(h.probeSent));
+  SendMessage(LIFX_DEVICE_ECHOREQUEST, device->MacAddress(), IPAddress(device->IpAddress()), sizeof(lifx_payload_device_echo));
+}
+
+void Lifx::DeviceSeen(Device *device, uint16_t messageType, byte *payload) {
+  //  any message shows the device is there, an EchoResponse to the outstanding probe also gives the round trip
+  lifx_device_health &h = _health[device->Index()];
+  unsigned long now = Millis();
+
+  h.lastActivity = now;
+  h.missed = 0;
+  if (h.state == LIFX_HEALTH_OFFLINE)
+  {
+    h.state = LIFX_HEALTH_DEGRADED;
+    h.interval = LIFX_HEALTH_FAST_INTERVAL;
+    _offline.Clear(device->Index());
+    QueueEvent(LIFX_EVENT_ADDED, device, NULL);
+  }
+
+  if (messageType == LIFX_DEVICE_ECHORESPONSE && h.probing && memcmp(payload, &h.probeSent, sizeof(h.probeSent)) == 0)
+  {
+    uint16_t rtt = (now - h.probeSent > 0xFFFF) ? 0xFFFF : (now - h.probeSent);
+    h.probing = false;
+    h.rtt = (h.rtt == 0) ? rtt : ((7 * (uint32_t) h.rtt + rtt) / 8);
+    if (h.rtt > LIFX_HEALTH_DEGRADED_RTT)
+    {
+      h.state = LIFX_HEALTH_DEGRADED;
+      h.interval = LIFX_HEALTH_FAST_INTERVAL;
+    }
+    else
+    {
+      h.state = LIFX_HEALTH_ONLINE;
+      h.interval = (2 * h.interval > LIFX_HEALTH_SLOW_INTERVAL) ? LIFX_HEALTH_SLOW_INTERVAL : 2 * h.interval;
+    }
+  }
+}
+
+void Lifx::SetClock(ClockFunction f) {
+  //  NULL restores millis()
+  _clockFunction = f;
+}
+
+void Lifx::SetRecorder(LifxRecorder *recorder) {
+  _recorder = recorder;
+}
+
+void Lifx::SetTransmitEnable(bool enable) {
+  _transmitEnabled = enable;
+}
+
+unsigned long Lifx::Millis() {
+  return (_clockFunction != NULL) ? _clockFunction() : millis();
+}
+
 void Lifx::PrintDevices() {
   int i;
   
@@ -435,13 +1102,28 @@ void Lifx::PrintDevices() {
   }
 }
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-Device::Device(byte macAddress[], uint32_t ipAddress)
+Device::Device(byte macAddress[], uint32_t ipAddress, uint16_t index, lifx_light_table &lights) :
+  Power(lights.power[index]),
+  Hue(lights.hue[index]),
+  Saturation(lights.saturation[index]),
+  Brightness(lights.brightness[index]),
+  Kelvin(lights.kelvin[index]),
+  LastMessageType(lights.lastMessageType[index])
 {
   memcpy(_macAddress, macAddress, LIFX_MAC_LEN);
   _ipAddress = ipAddress;
-  Label[0] = 0;
-  Group[0] = 0;
-  Location[0] = 0;
+  _index = index;
+  memset(Label, 0, sizeof(Label));
+  memset(Group, 0, sizeof(Group));
+  memset(Location, 0, sizeof(Location));
+  memset(LocationId, 0, LIFX_ID_LEN);
+  memset(GroupId, 0, LIFX_ID_LEN);
+  Power = 0;
+  Hue = 0;
+  Saturation = 0;
+  Brightness = 0;
+  Kelvin = 0;
+  LastMessageType = 0;
   return;
 }
 
@@ -455,6 +1137,11 @@ uint32_t Device::IpAddress()
   return _ipAddress;
 }
 
+uint16_t Device::Index()
+{
+  return _index;
+}
+
 char *Device::MacAddressString()
 {
   sprintf(_macString, "%02x:%02x:%02x:%02x:%02x:%02x", _macAddress[0], _macAddress[1], _macAddress[2], _macAddress[3], _macAddress[4], _macAddress[5]);
@@ -20,18 +20,27 @@
 /* Support for color devices and other features on ESP32 by Dan Julio   */
 /* Jan 2022.                                                            */
 /************************************************************************/
-
+#ifndef _LIFX_
+#define _LIFX_
 #include <stdint.h>
 #include <Arduino.h>
 #include <vector>
+#if defined(LIFX_HOST_UDP)
+#include "LifxHostUdp.h"
+#else
 #include <WiFi.h>
 #include <WiFiUdp.h>
+#endif
+#include "LifxSelector.h"
+#include "LifxRecorder.h"
+#include "LifxColor.h"
 
 
 //#define DEBUG 1
 
 #define LIFX_PORT 56700
 #define LIFX_INCOMING_PACKET_BUFFER_LEN 300   // Packet buffer size
+#define LIFX_OUTGOING_PACKET_BUFFER_LEN 128   // Largest message Lifx sends
 #define LIFX_MAC_LEN 6                        // Length in bytes of MAC address numbers
 // Message types
 #define LIFX_DEVICE_GETSERVICE 02
@@ -47,10 +56,23 @@
 #define LIFX_DEVICE_STATELOCATION 50
 #define LIFX_DEVICE_GETGROUP 51
 #define LIFX_DEVICE_STATEGROUP 53
+#define LIFX_DEVICE_ECHOREQUEST 58
+#define LIFX_DEVICE_ECHORESPONSE 59
 #define LIFX_LIGHT_GET 101
 #define LIFX_LIGHT_SETCOLOR 102
 #define LIFX_LIGHT_STATE 107
 #define LIFX_REDISCOVERY_INTERVAL 300000
+#define LIFX_MAX_DEVICES 256                  // Device table capacity, a multiple of 32
+// Health monitor
+#define LIFX_HEALTH_TICK 50                   // Msec between health monitor passes
+#define LIFX_HEALTH_PROBES_PER_TICK 4         // Most probes sent in one pass
+#define LIFX_HEALTH_FAST_INTERVAL 2000        // Probe interval for new, degraded or recovering devices
+#define LIFX_HEALTH_SLOW_INTERVAL 60000       // Longest probe interval, reached by doubling while a device stays online
+#define LIFX_HEALTH_PROBE_TIMEOUT 1000        // Msec to wait for an EchoResponse
+#define LIFX_HEALTH_DEGRADED_RTT 250          // Smoothed round trip msec above which a device is degraded
+#define LIFX_HEALTH_OFFLINE_MISSES 3          // Consecutive missed probes before a device is offline
+#define LIFX_HEALTH_REDISCOVERY_INTERVAL 3600000  // Rediscovery interval while the monitor runs
+#define LIFX_HEALTH_MIN_REDISCOVERY 60000     // Shortest time between rediscoveries started by a device going offline
 
 
 
@@ -115,6 +137,12 @@ typedef struct {
 } lifx_payload_device_group;
 #pragma pack(pop)
 
+#pragma pack(push, 1)
+typedef struct {
+  byte echoing[64];
+} lifx_payload_device_echo;
+#pragma pack(pop)
+
 #pragma pack(push, 1)
 typedef struct {
   uint16_t hue;
@@ -141,25 +169,117 @@ typedef struct {
 
 
 
+// Transport.  A Linux host build (LIFX_HOST_UDP) sends and receives batches with one system call each,
+// WiFiUDP moves one datagram per call so its batches are kept small
+#if defined(LIFX_HOST_UDP)
+typedef LifxHostUdp LifxUdp;
+typedef lifx_host_packet lifx_tx_packet;
+#define LIFX_TX_BATCH_LEN LIFX_HOST_UDP_BATCH_LEN
+#define LIFX_RX_BATCH_LEN 32
+#else
+typedef WiFiUDP LifxUdp;
+typedef struct {
+  byte data[LIFX_OUTGOING_PACKET_BUFFER_LEN];
+  uint16_t len;
+  uint32_t ipAddress;
+} lifx_tx_packet;
+#define LIFX_TX_BATCH_LEN 8
+#endif
+
+typedef struct {
+  uint32_t txPackets;
+  uint32_t txCalls;             // Transport send calls, estimated while transmit is disabled
+  uint32_t rxPackets;
+  uint32_t rxCalls;             // Transport receive calls that returned data
+  uint32_t txDropped;           // Datagrams the transport would not take
+} lifx_transport_stats;
+
+
+
+// Hot light state held as one column per field, indexed by device table slot, so
+// group queries scan contiguous memory instead of chasing Device pointers
+typedef struct {
+  uint16_t power[LIFX_MAX_DEVICES];
+  uint16_t hue[LIFX_MAX_DEVICES];
+  uint16_t saturation[LIFX_MAX_DEVICES];
+  uint16_t brightness[LIFX_MAX_DEVICES];
+  uint16_t kelvin[LIFX_MAX_DEVICES];
+  uint16_t lastMessageType[LIFX_MAX_DEVICES];
+} lifx_light_table;
+
+// Aggregate light state over a group or selector
+typedef struct {
+  uint16_t count;             // Devices in the set
+  uint16_t on;                // Devices with non-zero power
+  uint16_t off;
+  uint16_t minBrightness;     // Brightness over all devices in the set, 0 if empty
+  uint16_t maxBrightness;
+  uint16_t meanBrightness;
+} lifx_group_state;
+
+
+
+// Device liveness as seen by the health monitor
+typedef enum {LIFX_HEALTH_ONLINE, LIFX_HEALTH_DEGRADED, LIFX_HEALTH_OFFLINE} lifx_health_state;
+
+typedef struct {
+  uint8_t state;                // lifx_health_state
+  uint8_t missed;               // Consecutive unanswered probes
+  bool probing;                 // EchoRequest outstanding
+  uint16_t rtt;                 // Smoothed round trip msec
+  uint32_t interval;            // Current probe interval
+  unsigned long probeSent;
+  unsigned long lastActivity;   // Last message from the device or probe timeout
+} lifx_device_health;
+
+
+
+// Device table changes reported to the DeviceChangeCallback.  Only the members for the field are set, the rest are zero.
+// Callbacks run once the message or timer tick that raised them is dealt with, so they see the updated table and may call
+// back into Lifx.  DeviceAddedCallback is also called when a device comes back online, DeviceRemovedCallback when the
+// health monitor marks it offline.
+typedef enum {LIFX_CHANGE_POWER, LIFX_CHANGE_COLOR, LIFX_CHANGE_LABEL, LIFX_CHANGE_GROUP, LIFX_CHANGE_LOCATION, LIFX_CHANGE_IP_ADDRESS} lifx_change_field;
+
+typedef struct {
+  uint8_t field;                // lifx_change_field
+  uint16_t oldPower;
+  uint16_t newPower;
+  lifx_hsbk oldColor;
+  lifx_hsbk newColor;
+  char oldText[33];             // Label, group or location name
+  char newText[33];
+  uint32_t oldIpAddress;
+  uint32_t newIpAddress;
+} lifx_device_change;
+
+
+
+// Cold per-device metadata.  The light state members refer into the owning Lifx light table.
 class Device
 {
   public:
-    Device(byte macAddress[], uint32_t ipAddress);
+    Device(byte macAddress[], uint32_t ipAddress, uint16_t index, lifx_light_table &lights);
     byte *MacAddress();
     uint32_t IpAddress();
     char *MacAddressString();
+    uint16_t Index();
     uint32_t Product = 0;
     uint16_t Port = 0;
-    uint16_t Power = 0;
-    uint16_t Hue = 0;
-    uint16_t Saturation = 0;
-    uint16_t Brightness = 0;
-    uint16_t Kelvin = 0;
+    uint16_t &Power;
+    uint16_t &Hue;
+    uint16_t &Saturation;
+    uint16_t &Brightness;
+    uint16_t &Kelvin;
     char Label[32];
     char Location[32];
     char Group[32];
-    uint16_t LastMessageType = 0;
+    byte LocationId[LIFX_ID_LEN];
+    byte GroupId[LIFX_ID_LEN];
+    uint32_t LabelHash = 0;
+    uint16_t &LastMessageType;
   private:
+    friend class Lifx;
+    uint16_t _index;
     uint32_t _ipAddress;
     byte _macAddress[LIFX_MAC_LEN];
     char _macString[19];
@@ -167,9 +287,40 @@ class Device
 
 
 
+// A group known to the device table, keyed by the group UUID or, for devices that report no UUID, by label
+typedef struct {
+  byte id[LIFX_ID_LEN];
+  char label[32];               // From the report with the newest updatedAt
+  uint64_t updatedAt;
+  LifxDeviceSet members;
+} lifx_group;
+
+// A device callback waiting for DispatchEvents
+#define LIFX_EVENT_CHANGE 0
+#define LIFX_EVENT_ADDED 1
+#define LIFX_EVENT_REMOVED 2
+
+typedef struct {
+  uint8_t event;
+  Device *device;
+  lifx_device_change change;    // LIFX_EVENT_CHANGE only
+} lifx_device_event;
+
+// A selector compiled against the device table
+typedef struct {
+  LifxSelector selector;
+  LifxDeviceSet members;
+  bool inUse;
+} lifx_compiled_selector;
+
+
+
 class Lifx
 {
   typedef void (*CallbackFunction) (Lifx&);
+  typedef unsigned long (*ClockFunction) (void);
+  typedef void (*DeviceChangeFunction) (Lifx&, Device*, const lifx_device_change&);
+  typedef void (*DeviceFunction) (Lifx&, Device*);
   
   public:
     Lifx();
@@ -180,8 +331,20 @@ class Lifx
     uint16_t DeviceCount();
     Device* GetIndexedDevice(int n);
     void DiscoveryCompleteCallback(CallbackFunction f);
+    void DeviceChangeCallback(DeviceChangeFunction f);
+    void DeviceAddedCallback(DeviceFunction f);
+    void DeviceRemovedCallback(DeviceFunction f);
     void DoDiscovery();
     void ReceivedMessage(byte packet[], int packetLen);
+    void ReceivedMessage(byte packet[], int packetLen, IPAddress ipAddress);
+    void ServiceTimers();
+    void SetClock(ClockFunction f);
+    void SetRecorder(LifxRecorder *recorder);
+    void SetTransmitEnable(bool enable);
+    unsigned long Millis();
+    void BeginBatch();
+    void EndBatch();
+    void GetTransportStats(lifx_transport_stats *stats);
     void PrintDevices();
     void SendMessage(uint16_t messageType, byte *macAddress, IPAddress ipAddress, int payloadLen);
     void SetBrightnessByGroup(char *group, uint16_t brightness, uint32_t duration = 0);
@@ -190,6 +353,7 @@ class Lifx
     void SetColorByGroup(char *group, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration = 0);
     void SetColorByLabel(char *label, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration = 0);
     void SetDeviceColor(Device *dev, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration = 0);
+    void SetDeviceColor(Device *dev, const lifx_hsbk &hsbk, uint32_t duration = 0);
     void SetDevicePower(Device *dev, uint16_t power);
     void SetPowerByGroup(char *group, uint16_t power);
     void SetPowerByLabel(char *label, uint16_t power);
@@ -200,8 +364,45 @@ class Lifx
     uint16_t StateBrightnessByLabel(char *label);
     uint16_t StatePowerByGroup(char *group);
     uint16_t StatePowerByLabel(char *label);
+    int CompileSelector(const LifxSelector &selector);
+    void ReleaseSelector(int handle);
+    const LifxDeviceSet *SelectorDevices(int handle);
+    void SetBrightnessBySelector(int handle, uint16_t brightness, uint32_t duration = 0);
+    void SetColorBySelector(int handle, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration = 0);
+    void SetPowerBySelector(int handle, uint16_t power);
+    uint16_t StateBrightnessBySelector(int handle);
+    uint16_t StatePowerBySelector(int handle);
+    void StateByGroup(char *group, lifx_group_state *state);
+    void StateBySelector(int handle, lifx_group_state *state);
+    bool StateAnyOnByGroup(char *group);
+    bool StateAllOnByGroup(char *group);
+    void EnableHealthMonitor(bool enable);
+    const lifx_device_health *DeviceHealth(Device *dev);
+    const LifxDeviceSet *OfflineDevices();
   private:
+    void AccumulateState(const LifxDeviceSet &set, lifx_group_state *state, uint32_t *brightnessSum);
+    int FindGroup(const char *label, int start);
+    LifxDeviceSet *SelectorSet(int handle);
+    void UpdateMembership(Device *device);
+    void UpdateGroup(Device *device, lifx_payload_device_group *group);
+    void DoHealthMonitor();
+    void DeviceSeen(Device *device, uint16_t messageType, byte *payload);
+    void SendProbe(Device *device);
+    void FlushBatch();
+    void UpdatePower(Device *device, uint16_t power);
+    void UpdateColor(Device *device, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin);
+    void UpdateText(Device *device, uint8_t field, char *text, const char *value);
+    void QueueEvent(uint8_t event, Device *device, const lifx_device_change *change);
+    void DispatchEvents();
     std::vector<Device *> _devices;
+    lifx_light_table _lights;
+    std::vector<lifx_device_health> _health;
+    LifxDeviceSet _offline;
+    bool _healthMonitor = false;
+    unsigned long _healthTimer = 0;
+    unsigned long _rediscoveryInterval = LIFX_REDISCOVERY_INTERVAL;
+    std::vector<lifx_group> _groups;
+    std::vector<lifx_compiled_selector> _selectors;
     lifx_header _header;
     union
     {
@@ -209,16 +410,35 @@ class Lifx
       lifx_payload_device_label label;
       lifx_payload_device_location location;
       lifx_payload_device_group group;
+      lifx_payload_device_echo echo;
       lifx_payload_light_state lightState;
       lifx_payload_light_setcolor setColor;
     } _payload;
     
-    WiFiUDP _udp;
+    LifxUdp _udp;
+    lifx_tx_packet _txBatch[LIFX_TX_BATCH_LEN];
+    int _txCount = 0;
+    int _txBatchDepth = 0;
+    #if defined(LIFX_HOST_UDP)
+    lifx_host_packet _rxBatch[LIFX_RX_BATCH_LEN];
+    #endif
+    lifx_transport_stats _transportStats = {0, 0, 0, 0, 0};
     CallbackFunction _discoveryCompleteFunction = NULL;
+    DeviceChangeFunction _deviceChangeFunction = NULL;
+    DeviceFunction _deviceAddedFunction = NULL;
+    DeviceFunction _deviceRemovedFunction = NULL;
+    std::vector<lifx_device_event> _events;
+    uint16_t _eventHead = 0;
+    ClockFunction _clockFunction = NULL;
+    LifxRecorder *_recorder = NULL;
+    bool _transmitEnabled = true;
     bool _discoveryUnderway = 0;
     bool _lightUpdateUnderway = 0;
-    unsigned long _discoveryTimer;
-    unsigned long _discoveryNextMsec;
-    int _discoveryBroadcastCount;
-    int _discoveryDeviceIndex;
+    unsigned long _discoveryTimer = 0;
+    unsigned long _discoveryNextMsec = 0;
+    int _discoveryBroadcastCount = 0;
+    int _discoveryDeviceIndex = 0;
 };
+
+
+#endif // _LIFX_
@@ -0,0 +1,216 @@
+/************************************************************************/
+/* Batch color conversion to LIFX HSBK.  Converts arrays of RGB888,     */
+/* CIE 1931 xy or color temperature into the packed 8 byte HSBK used by */
+/* the LIFX protocol using fixed-point arithmetic.  Pixels are worked   */
+/* in blocks with branch free inner loops so compilers can vectorize    */
+/* them, with a scalar path for the remainder.                          */
+/************************************************************************/
+#include <math.h>
+#include "LifxColor.h"
+
+
+// Hue sector offsets in 16.8 fixed point (65536 = 360 degrees)
+#define LIFX_HUE_OFFSET_G 5592405         // 120 degrees
+#define LIFX_HUE_OFFSET_B 11184811        // 240 degrees
+
+// XYZ to linear sRGB (D65) in 5.11 fixed point
+#define LIFX_XYZ_RX  6637
+#define LIFX_XYZ_RY -3148
+#define LIFX_XYZ_RZ -1021
+#define LIFX_XYZ_GX -1984
+#define LIFX_XYZ_GY  3842
+#define LIFX_XYZ_GZ    85
+#define LIFX_XYZ_BX   114
+#define LIFX_XYZ_BY  -418
+#define LIFX_XYZ_BZ  2165
+
+#define LIFX_GAMMA_LEN 1024               // Linear input resolution of the sRGB gamma table
+
+
+extern "C" {
+
+//
+// Tables, built on first use.  Divisions in the kernels are replaced by multiplies with these.
+//
+static bool lifx_color_ready = false;
+static uint32_t lifx_sat_recip[256];      // 65535 / max in 24.8 fixed point
+static int32_t lifx_hue_recip[256];       // (65536 / 6) / delta in 24.8 fixed point
+static uint8_t lifx_gamma[LIFX_GAMMA_LEN];
+
+
+static void lifx_color_init() {
+	int i;
+
+	lifx_sat_recip[0] = 0;
+	lifx_hue_recip[0] = 0;
+	for (i = 1; i < 256; i++) {
+		lifx_sat_recip[i] = (65535UL * 256 + i / 2) / i;
+		lifx_hue_recip[i] = (65536L * 256 + 3 * i) / (6 * i);
+	}
+
+	for (i = 0; i < LIFX_GAMMA_LEN; i++) {
+		float c = (float) i / (LIFX_GAMMA_LEN - 1);
+		c = (c <= 0.0031308f) ? (12.92f * c) : (1.055f * powf(c, 1.0f / 2.4f) - 0.055f);
+		lifx_gamma[i] = (uint8_t) (c * 255.0f + 0.5f);
+	}
+
+	lifx_color_ready = true;
+}
+
+
+/*
+ * Convert one pixel.  Written branch free to match the block kernel.
+ */
+static inline void lifx_rgb_pixel(int32_t r, int32_t g, int32_t b, lifx_hsbk *out) {
+	int32_t mx = (r > g) ? r : g;
+	int32_t mn = (r < g) ? r : g;
+	mx = (b > mx) ? b : mx;
+	mn = (b < mn) ? b : mn;
+	int32_t d = mx - mn;
+	bool isR = (mx == r);
+	bool isG = !isR && (mx == g);
+	int32_t diff = isR ? (g - b) : (isG ? (b - r) : (r - g));
+	int32_t off = isR ? 0 : (isG ? LIFX_HUE_OFFSET_G : LIFX_HUE_OFFSET_B);
+
+	out->hue = (uint16_t) ((off + diff * lifx_hue_recip[d] + 128) >> 8);
+	out->saturation = (uint16_t) ((d * lifx_sat_recip[mx] + 128) >> 8);
+	out->brightness = (uint16_t) (mx * 257);
+}
+
+
+/*
+ * Convert a block of n <= LIFX_COLOR_BLOCK pixels held a channel per array.
+ */
+static inline void lifx_rgb_block(const int32_t *r, const int32_t *g, const int32_t *b, uint16_t *h, uint16_t *s, uint16_t *v, int n) {
+	int j;
+
+	for (j = 0; j < n; j++) {
+		int32_t mx = (r[j] > g[j]) ? r[j] : g[j];
+		int32_t mn = (r[j] < g[j]) ? r[j] : g[j];
+		mx = (b[j] > mx) ? b[j] : mx;
+		mn = (b[j] < mn) ? b[j] : mn;
+		int32_t d = mx - mn;
+		int32_t isR = (mx == r[j]);
+		int32_t isG = !isR & (mx == g[j]);
+		int32_t diff = isR ? (g[j] - b[j]) : (isG ? (b[j] - r[j]) : (r[j] - g[j]));
+		int32_t off = isR ? 0 : (isG ? LIFX_HUE_OFFSET_G : LIFX_HUE_OFFSET_B);
+
+		h[j] = (uint16_t) ((off + diff * lifx_hue_recip[d] + 128) >> 8);
+		s[j] = (uint16_t) ((d * lifx_sat_recip[mx] + 128) >> 8);
+		v[j] = (uint16_t) (mx * 257);
+	}
+}
+
+
+void lifx_rgb888_to_hsbk(const uint8_t *rgb, lifx_hsbk *hsbk, int count, uint16_t kelvin) {
+	int32_t r[LIFX_COLOR_BLOCK], g[LIFX_COLOR_BLOCK], b[LIFX_COLOR_BLOCK];
+	uint16_t h[LIFX_COLOR_BLOCK], s[LIFX_COLOR_BLOCK], v[LIFX_COLOR_BLOCK];
+	int i, j;
+
+	if (!lifx_color_ready) lifx_color_init();
+
+	for (i = 0; i + LIFX_COLOR_BLOCK <= count; i += LIFX_COLOR_BLOCK) {
+		// Deinterleave so each channel is contiguous
+		for (j = 0; j < LIFX_COLOR_BLOCK; j++) {
+			r[j] = rgb[3 * j];
+			g[j] = rgb[3 * j + 1];
+			b[j] = rgb[3 * j + 2];
+		}
+
+		lifx_rgb_block(r, g, b, h, s, v, LIFX_COLOR_BLOCK);
+
+		for (j = 0; j < LIFX_COLOR_BLOCK; j++) {
+			hsbk[j].hue = h[j];
+			hsbk[j].saturation = s[j];
+			hsbk[j].brightness = v[j];
+			hsbk[j].kelvin = kelvin;
+		}
+
+		rgb += 3 * LIFX_COLOR_BLOCK;
+		hsbk += LIFX_COLOR_BLOCK;
+	}
+
+	// Remainder
+	for (; i < count; i++) {
+		lifx_rgb_pixel(rgb[0], rgb[1], rgb[2], hsbk);
+		hsbk->kelvin = kelvin;
+		rgb += 3;
+		hsbk++;
+	}
+}
+
+
+void lifx_xy_to_hsbk(const uint16_t *xy, const uint16_t *brightness, lifx_hsbk *hsbk, int count, uint16_t kelvin) {
+	// Hue and saturation only depend on the ratio of the channels so XYZ is taken with Y = y
+	// (x, y, 1 - x - y) which avoids the divide by y.  The clipped linear color is scaled so its
+	// largest channel is full scale, gamma encoded and then converted like RGB888.  Each block is
+	// worked in passes: matrix and clip, normalize, gamma lookup, then the RGB block kernel.  Black
+	// (all channels clipped to 0) falls out as hue and saturation 0 without a branch.
+	int32_t r[LIFX_COLOR_BLOCK], g[LIFX_COLOR_BLOCK], b[LIFX_COLOR_BLOCK];
+	uint16_t h[LIFX_COLOR_BLOCK], s[LIFX_COLOR_BLOCK], v[LIFX_COLOR_BLOCK];
+	float k[LIFX_COLOR_BLOCK];
+	int i, j, n;
+
+	if (!lifx_color_ready) lifx_color_init();
+
+	for (i = 0; i < count; i += n) {
+		n = (count - i < LIFX_COLOR_BLOCK) ? (count - i) : LIFX_COLOR_BLOCK;
+
+		for (j = 0; j < n; j++) {
+			int32_t x = xy[2 * j];
+			int32_t y = xy[2 * j + 1];
+			int32_t z = 65535 - x - y;
+			z = (z < 0) ? 0 : z;
+
+			int32_t rr = (LIFX_XYZ_RX * x + LIFX_XYZ_RY * y + LIFX_XYZ_RZ * z) >> 11;
+			int32_t gg = (LIFX_XYZ_GX * x + LIFX_XYZ_GY * y + LIFX_XYZ_GZ * z) >> 11;
+			int32_t bb = (LIFX_XYZ_BX * x + LIFX_XYZ_BY * y + LIFX_XYZ_BZ * z) >> 11;
+			r[j] = (rr < 0) ? 0 : rr;
+			g[j] = (gg < 0) ? 0 : gg;
+			b[j] = (bb < 0) ? 0 : bb;
+		}
+
+		// One reciprocal per pixel, which vectorizes where an integer divide would not
+		for (j = 0; j < n; j++) {
+			int32_t mx = (r[j] > g[j]) ? r[j] : g[j];
+			mx = (b[j] > mx) ? b[j] : mx;
+			k[j] = (float) (LIFX_GAMMA_LEN - 1) / (float) ((mx > 0) ? mx : 1);
+		}
+
+		for (j = 0; j < n; j++) {
+			r[j] = lifx_gamma[(int32_t) (r[j] * k[j] + 0.5f)];
+			g[j] = lifx_gamma[(int32_t) (g[j] * k[j] + 0.5f)];
+			b[j] = lifx_gamma[(int32_t) (b[j] * k[j] + 0.5f)];
+		}
+
+		lifx_rgb_block(r, g, b, h, s, v, n);
+
+		for (j = 0; j < n; j++) {
+			hsbk[j].hue = h[j];
+			hsbk[j].saturation = s[j];
+			hsbk[j].brightness = brightness[j];
+			hsbk[j].kelvin = kelvin;
+		}
+
+		xy += 2 * n;
+		brightness += n;
+		hsbk += n;
+	}
+}
+
+
+void lifx_kelvin_to_hsbk(const uint16_t *kelvin, const uint16_t *brightness, lifx_hsbk *hsbk, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		uint16_t k = kelvin[i];
+		k = (k < LIFX_KELVIN_MIN) ? LIFX_KELVIN_MIN : k;
+		k = (k > LIFX_KELVIN_MAX) ? LIFX_KELVIN_MAX : k;
+		hsbk[i].hue = 0;
+		hsbk[i].saturation = 0;
+		hsbk[i].brightness = brightness[i];
+		hsbk[i].kelvin = k;
+	}
+}
+
+}
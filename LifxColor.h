@@ -0,0 +1,50 @@
+/************************************************************************/
+/* Batch color conversion to LIFX HSBK.  Converts arrays of RGB888,     */
+/* CIE 1931 xy or color temperature into the packed 8 byte HSBK used by */
+/* the LIFX protocol using fixed-point arithmetic.  Pixels are worked   */
+/* in blocks with branch free inner loops so compilers can vectorize    */
+/* them, with a scalar path for the remainder.                          */
+/************************************************************************/
+#ifndef _LIFX_COLOR_
+#define _LIFX_COLOR_
+#include <stdint.h>
+
+
+#define LIFX_COLOR_BLOCK 16               // Pixels per block in the batch kernels
+#define LIFX_KELVIN_MIN 1500
+#define LIFX_KELVIN_MAX 9000
+
+
+extern "C" {
+
+// Same layout as the hue through kelvin fields of lifx_payload_light_setcolor and as each
+// entry of the multizone and tile color arrays
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+} lifx_hsbk;
+#pragma pack(pop)
+
+
+//
+// API
+//
+
+// rgb holds count packed R, G, B byte triples.  kelvin is stored in every output entry.
+void lifx_rgb888_to_hsbk(const uint8_t *rgb, lifx_hsbk *hsbk, int count, uint16_t kelvin);
+
+// xy holds count pairs of CIE 1931 x, y chromaticity scaled so 65535 = 1.0, brightness
+// holds count brightness values.  Colors outside the sRGB gamut are clipped to it.
+void lifx_xy_to_hsbk(const uint16_t *xy, const uint16_t *brightness, lifx_hsbk *hsbk, int count, uint16_t kelvin);
+
+// kelvin and brightness hold count values.  The output is unsaturated white with kelvin
+// clamped to the range LIFX lights accept.
+void lifx_kelvin_to_hsbk(const uint16_t *kelvin, const uint16_t *brightness, lifx_hsbk *hsbk, int count);
+
+}
+
+
+#endif // _LIFX_COLOR_
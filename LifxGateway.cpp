@@ -0,0 +1,347 @@
+/************************************************************************/
+/* LAN gateway for the Lifx library.  One controller runs LifxGateway   */
+/* alongside its Lifx instance and owns discovery and the device table. */
+/* Other controllers use LifxGatewayClient to send it commands and      */
+/* state queries over a small UDP protocol.  The gateway merges pending */
+/* commands per bulb, rate limits what it sends to each bulb and        */
+/* answers state queries from its cache, so any number of clients cost  */
+/* the bulbs no more traffic than one.                                  */
+/************************************************************************/
+#include "LifxGateway.h"
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+LifxGateway::LifxGateway(Lifx &lifx) :
+  _lifx(lifx)
+{
+}
+
+void LifxGateway::begin(uint16_t port) {
+  _udp.begin(port);
+}
+
+void LifxGateway::loop() {
+  //  call after Lifx::loop(). handles at most one client request per call, like Lifx::loop()
+  byte packetBuffer[sizeof(lifx_gateway_request)];
+  int packetLen = _udp.parsePacket();
+
+  if (packetLen == sizeof(lifx_gateway_request))
+  {
+    _udp.read(packetBuffer, sizeof(packetBuffer));
+    HandleRequest((lifx_gateway_request *) packetBuffer, _udp.remoteIP(), _udp.remotePort());
+  }
+  else if (packetLen)
+  {
+    //  not ours, discard it
+    _udp.flush();
+  }
+
+  Flush();
+}
+
+void LifxGateway::SetMinInterval(uint16_t msec) {
+  _minInterval = msec;
+}
+
+uint32_t LifxGateway::Requests() {
+  return _requests;
+}
+
+uint32_t LifxGateway::Merged() {
+  //  number of per-bulb commands replaced by a later one before they were sent
+  return _merged;
+}
+
+void LifxGateway::HandleRequest(lifx_gateway_request *req, IPAddress ipAddress, uint16_t port) {
+  lifx_gateway_reply reply;
+  const LifxDeviceSet *set;
+  int handle;
+  int i;
+
+  //  anything this version doesn't understand is dropped rather than guessed at, an unknown target must not
+  //  fall back to every bulb in the house
+  if (req->magic != LIFX_GATEWAY_MAGIC) return;
+  if (req->command < LIFX_GATEWAY_SETPOWER || req->command > LIFX_GATEWAY_GETSTATE) return;
+  if (req->target > LIFX_GATEWAY_TARGET_DEVICE) return;
+  _requests++;
+
+  #ifdef DEBUG
+  Serial.printf("Gateway request %d from %s, target %d %.32s\n", req->command, ipAddress.toString().c_str(), req->target, req->name);
+  #endif
+
+  if (req->target == LIFX_GATEWAY_TARGET_DEVICE)
+  {
+    for (i = 0; i < _lifx.DeviceCount(); i++)
+    {
+      if (memcmp(_lifx.GetIndexedDevice(i)->MacAddress(), req->mac, LIFX_MAC_LEN) == 0) break;
+    }
+    if (i == _lifx.DeviceCount()) return;
+
+    if (req->command == LIFX_GATEWAY_GETSTATE)
+    {
+      //  a single device is its own aggregate
+      memset(&reply.state, 0, sizeof(reply.state));
+      reply.state.count = 1;
+      reply.state.on = (_lifx.GetIndexedDevice(i)->Power != 0);
+      reply.state.off = 1 - reply.state.on;
+      reply.state.minBrightness = _lifx.GetIndexedDevice(i)->Brightness;
+      reply.state.maxBrightness = reply.state.minBrightness;
+      reply.state.meanBrightness = reply.state.minBrightness;
+    }
+    else
+    {
+      Queue(i, req);
+      return;
+    }
+  }
+  else
+  {
+    handle = TargetSelector(req);
+    set = _lifx.SelectorDevices(handle);
+    if (set == NULL) return;
+
+    //  offline bulbs are left out, as the Lifx group and selector methods do
+    if (req->command != LIFX_GATEWAY_GETSTATE)
+    {
+      for (i = set->Next(0, _lifx.OfflineDevices()); i >= 0; i = set->Next(i + 1, _lifx.OfflineDevices()))
+        Queue(i, req);
+      return;
+    }
+
+    _lifx.StateBySelector(handle, &reply.state);
+    i = set->Next(0, _lifx.OfflineDevices());
+  }
+
+  //  state queries are answered from the device table without touching the bulbs
+  reply.magic = LIFX_GATEWAY_MAGIC;
+  reply.command = LIFX_GATEWAY_STATE;
+  reply.sequence = req->sequence;
+  if (i >= 0)
+  {
+    Device *dev = _lifx.GetIndexedDevice(i);
+    reply.power = dev->Power;
+    reply.hue = dev->Hue;
+    reply.saturation = dev->Saturation;
+    reply.brightness = dev->Brightness;
+    reply.kelvin = dev->Kelvin;
+  }
+  else
+  {
+    reply.power = reply.hue = reply.saturation = reply.brightness = reply.kelvin = 0;
+  }
+  _udp.beginPacket(ipAddress, port);
+  _udp.write((const uint8_t *) &reply, sizeof(reply));
+  _udp.endPacket();
+}
+
+int LifxGateway::TargetSelector(lifx_gateway_request *req) {
+  //  label and group targets are compiled once into Lifx selectors and kept, so repeated commands to
+  //  the same group are a bitset walk. the cache is small and reused round robin. names are matched
+  //  exactly, '*' included, as Lifx::SetPowerByLabel and the other ByLabel and ByGroup methods do.
+  //  returns -1 for an unknown target
+  LifxSelector selector;
+  char name[33];
+
+  //  like a LIFX label the name may fill all 32 bytes without a NUL
+  memcpy(name, req->name, 32);
+  name[32] = 0;
+
+  for (lifx_gateway_selector &s: _selectors)
+  {
+    if (s.target == req->target && strncmp(s.name, req->name, 32) == 0) return s.handle;
+  }
+
+  switch (req->target)
+  {
+    case LIFX_GATEWAY_TARGET_ALL:
+      selector = LifxSelector::All();
+      break;
+
+    case LIFX_GATEWAY_TARGET_LABEL:
+      selector = LifxSelector::Label(name, LIFX_MATCH_LITERAL);
+      break;
+
+    case LIFX_GATEWAY_TARGET_GROUP:
+      selector = LifxSelector::Group(name, LIFX_MATCH_LITERAL);
+      break;
+
+    default:
+      return -1;
+  }
+
+  lifx_gateway_selector *entry;
+  if (_selectors.size() < LIFX_GATEWAY_SELECTOR_CACHE)
+  {
+    _selectors.push_back(lifx_gateway_selector());
+    entry = &_selectors.back();
+  }
+  else
+  {
+    entry = &_selectors[_nextEvict];
+    _nextEvict = (_nextEvict + 1) % LIFX_GATEWAY_SELECTOR_CACHE;
+    _lifx.ReleaseSelector(entry->handle);
+  }
+  entry->target = req->target;
+  strncpy(entry->name, req->name, 32);
+  entry->handle = _lifx.CompileSelector(selector);
+  return entry->handle;
+}
+
+void LifxGateway::Queue(uint16_t n, lifx_gateway_request *req) {
+  //  merge the command into what is already waiting for this bulb
+  if (n >= _pending.size()) _pending.resize(n + 1, lifx_gateway_pending());
+  lifx_gateway_pending &p = _pending[n];
+
+  switch (req->command)
+  {
+    case LIFX_GATEWAY_SETPOWER:
+      if (p.flags & LIFX_GATEWAY_PENDING_POWER) _merged++;
+      p.flags |= LIFX_GATEWAY_PENDING_POWER;
+      p.power = req->power;
+      break;
+
+    case LIFX_GATEWAY_SETCOLOR:
+      if (p.flags & (LIFX_GATEWAY_PENDING_COLOR | LIFX_GATEWAY_PENDING_BRIGHTNESS)) _merged++;
+      p.flags = (p.flags & ~LIFX_GATEWAY_PENDING_BRIGHTNESS) | LIFX_GATEWAY_PENDING_COLOR;
+      p.hue = req->hue;
+      p.saturation = req->saturation;
+      p.brightness = req->brightness;
+      p.kelvin = req->kelvin;
+      p.duration = req->duration;
+      break;
+
+    case LIFX_GATEWAY_SETBRIGHTNESS:
+      //  a brightness change folds into a pending color
+      if (p.flags & (LIFX_GATEWAY_PENDING_COLOR | LIFX_GATEWAY_PENDING_BRIGHTNESS)) _merged++;
+      if (!(p.flags & LIFX_GATEWAY_PENDING_COLOR)) p.flags |= LIFX_GATEWAY_PENDING_BRIGHTNESS;
+      p.brightness = req->brightness;
+      p.duration = req->duration;
+      break;
+
+    default:
+      return;
+  }
+  _dirty.Set(n);
+}
+
+void LifxGateway::Flush() {
+  //  send what is pending to each bulb that has not been sent to in the last _minInterval msec. commands
+  //  for a bulb that has gone offline since they were queued are dropped rather than sent late
+  unsigned long now = _lifx.Millis();
+
+  _lifx.BeginBatch();
+
+  for (int i = _dirty.Next(0); i >= 0; i = _dirty.Next(i + 1))
+  {
+    lifx_gateway_pending &p = _pending[i];
+    if (_lifx.OfflineDevices()->Test(i))
+    {
+      p.flags = 0;
+      _dirty.Clear(i);
+      continue;
+    }
+    if ((now - p.lastSent) < _minInterval) continue;
+
+    Device *dev = _lifx.GetIndexedDevice(i);
+    if (p.flags & LIFX_GATEWAY_PENDING_POWER)
+      _lifx.SetDevicePower(dev, p.power);
+    if (p.flags & LIFX_GATEWAY_PENDING_COLOR)
+      _lifx.SetDeviceColor(dev, p.hue, p.saturation, p.brightness, p.kelvin, p.duration);
+    else if (p.flags & LIFX_GATEWAY_PENDING_BRIGHTNESS)
+      _lifx.SetDeviceBrightness(dev, p.brightness, p.duration);
+
+    p.flags = 0;
+    p.lastSent = now;
+    _dirty.Clear(i);
+  }
+  _lifx.EndBatch();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void LifxGatewayClient::begin(IPAddress gateway, uint16_t port) {
+  //  replies come back to the port the requests are sent from
+  _gateway = gateway;
+  _port = port;
+  _udp.begin(port + 1);
+  memset(&_request, 0, sizeof(_request));
+  _request.magic = LIFX_GATEWAY_MAGIC;
+}
+
+void LifxGatewayClient::Send(uint8_t command, uint8_t target, const char *name) {
+  _request.command = command;
+  _request.target = target;
+  _request.sequence = ++_sequence;
+  memset(_request.name, 0, sizeof(_request.name));
+  memcpy(_request.name, name, strnlen(name, sizeof(_request.name)));
+
+  _udp.beginPacket(_gateway, _port);
+  _udp.write((const uint8_t *) &_request, sizeof(_request));
+  _udp.endPacket();
+}
+
+void LifxGatewayClient::SetBrightnessByGroup(char *group, uint16_t brightness, uint32_t duration) {
+  _request.brightness = brightness;
+  _request.duration = duration;
+  Send(LIFX_GATEWAY_SETBRIGHTNESS, LIFX_GATEWAY_TARGET_GROUP, group);
+}
+
+void LifxGatewayClient::SetBrightnessByLabel(char *label, uint16_t brightness, uint32_t duration) {
+  _request.brightness = brightness;
+  _request.duration = duration;
+  Send(LIFX_GATEWAY_SETBRIGHTNESS, LIFX_GATEWAY_TARGET_LABEL, label);
+}
+
+void LifxGatewayClient::SetColorByGroup(char *group, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration) {
+  _request.hue = hue;
+  _request.saturation = saturation;
+  _request.brightness = brightness;
+  _request.kelvin = kelvin;
+  _request.duration = duration;
+  Send(LIFX_GATEWAY_SETCOLOR, LIFX_GATEWAY_TARGET_GROUP, group);
+}
+
+void LifxGatewayClient::SetColorByLabel(char *label, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration) {
+  _request.hue = hue;
+  _request.saturation = saturation;
+  _request.brightness = brightness;
+  _request.kelvin = kelvin;
+  _request.duration = duration;
+  Send(LIFX_GATEWAY_SETCOLOR, LIFX_GATEWAY_TARGET_LABEL, label);
+}
+
+void LifxGatewayClient::SetPowerByGroup(char *group, uint16_t power) {
+  _request.power = power;
+  Send(LIFX_GATEWAY_SETPOWER, LIFX_GATEWAY_TARGET_GROUP, group);
+}
+
+void LifxGatewayClient::SetPowerByLabel(char *label, uint16_t power) {
+  _request.power = power;
+  Send(LIFX_GATEWAY_SETPOWER, LIFX_GATEWAY_TARGET_LABEL, label);
+}
+
+bool LifxGatewayClient::StateByGroup(char *group, lifx_gateway_reply *reply, uint16_t timeoutMsec) {
+  return State(LIFX_GATEWAY_TARGET_GROUP, group, reply, timeoutMsec);
+}
+
+bool LifxGatewayClient::StateByLabel(char *label, lifx_gateway_reply *reply, uint16_t timeoutMsec) {
+  return State(LIFX_GATEWAY_TARGET_LABEL, label, reply, timeoutMsec);
+}
+
+bool LifxGatewayClient::State(uint8_t target, const char *name, lifx_gateway_reply *reply, uint16_t timeoutMsec) {
+  //  blocks for up to timeoutMsec waiting for the matching reply
+  unsigned long start = millis();
+
+  Send(LIFX_GATEWAY_GETSTATE, target, name);
+  while ((millis() - start) < timeoutMsec)
+  {
+    if (_udp.parsePacket() == sizeof(lifx_gateway_reply))
+    {
+      _udp.read((byte *) reply, sizeof(lifx_gateway_reply));
+      if (reply->magic == LIFX_GATEWAY_MAGIC && reply->command == LIFX_GATEWAY_STATE && reply->sequence == _sequence)
+        return true;
+    }
+    delay(1);
+  }
+  return false;
+}
@@ -0,0 +1,141 @@
+/************************************************************************/
+/* LAN gateway for the Lifx library.  One controller runs LifxGateway   */
+/* alongside its Lifx instance and owns discovery and the device table. */
+/* Other controllers use LifxGatewayClient to send it commands and      */
+/* state queries over a small UDP protocol.  The gateway merges pending */
+/* commands per bulb, rate limits what it sends to each bulb and        */
+/* answers state queries from its cache, so any number of clients cost  */
+/* the bulbs no more traffic than one.                                  */
+/************************************************************************/
+#ifndef _LIFX_GATEWAY_
+#define _LIFX_GATEWAY_
+#include <stdint.h>
+#include <vector>
+#include "Lifx.h"
+
+
+#define LIFX_GATEWAY_PORT 56710
+#define LIFX_GATEWAY_MAGIC 0x5847                 // "GX"
+#define LIFX_GATEWAY_MIN_INTERVAL 50              // Default msec between sends to one bulb (LIFX ask for <= 20 msg/sec)
+#define LIFX_GATEWAY_SELECTOR_CACHE 16            // Compiled label and group selectors kept by the gateway
+#define LIFX_GATEWAY_REPLY_TIMEOUT 100            // Default msec a client waits for a state reply
+
+// Commands
+#define LIFX_GATEWAY_SETPOWER 1
+#define LIFX_GATEWAY_SETCOLOR 2
+#define LIFX_GATEWAY_SETBRIGHTNESS 3
+#define LIFX_GATEWAY_GETSTATE 4
+#define LIFX_GATEWAY_STATE 5
+
+// Targets
+#define LIFX_GATEWAY_TARGET_ALL 0
+#define LIFX_GATEWAY_TARGET_LABEL 1
+#define LIFX_GATEWAY_TARGET_GROUP 2
+#define LIFX_GATEWAY_TARGET_DEVICE 3              // By MAC address
+
+// Pending command flags
+#define LIFX_GATEWAY_PENDING_POWER 0x01
+#define LIFX_GATEWAY_PENDING_COLOR 0x02
+#define LIFX_GATEWAY_PENDING_BRIGHTNESS 0x04
+
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;
+  uint8_t  command;
+  uint8_t  target;
+  uint8_t  sequence;
+  uint8_t  mac[LIFX_MAC_LEN];
+  char     name[32];          // Label or group, NUL terminated unless it fills all 32 bytes
+  uint16_t power;
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+  uint32_t duration;
+} lifx_gateway_request;
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;
+  uint8_t  command;
+  uint8_t  sequence;
+  lifx_group_state state;       // Over every targeted device
+  uint16_t power;               // First targeted device
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+} lifx_gateway_reply;
+#pragma pack(pop)
+
+// Commands waiting to go to one bulb, later commands replace earlier ones
+typedef struct {
+  uint8_t  flags;
+  uint16_t power;
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+  uint32_t duration;
+  unsigned long lastSent;
+} lifx_gateway_pending;
+
+typedef struct {
+  uint8_t target;
+  char name[32];
+  int handle;
+} lifx_gateway_selector;
+
+
+class LifxGateway
+{
+  public:
+    LifxGateway(Lifx &lifx);
+    void begin(uint16_t port = LIFX_GATEWAY_PORT);
+    void loop();
+    void SetMinInterval(uint16_t msec);
+    void HandleRequest(lifx_gateway_request *req, IPAddress ipAddress, uint16_t port);
+    uint32_t Requests();
+    uint32_t Merged();
+  private:
+    int TargetSelector(lifx_gateway_request *req);
+    void Queue(uint16_t n, lifx_gateway_request *req);
+    void Flush();
+    Lifx &_lifx;
+    LifxUdp _udp;
+    std::vector<lifx_gateway_pending> _pending;
+    LifxDeviceSet _dirty;
+    std::vector<lifx_gateway_selector> _selectors;
+    int _nextEvict = 0;
+    uint16_t _minInterval = LIFX_GATEWAY_MIN_INTERVAL;
+    uint32_t _requests = 0;
+    uint32_t _merged = 0;
+};
+
+
+class LifxGatewayClient
+{
+  public:
+    void begin(IPAddress gateway, uint16_t port = LIFX_GATEWAY_PORT);
+    void SetBrightnessByGroup(char *group, uint16_t brightness, uint32_t duration = 0);
+    void SetBrightnessByLabel(char *label, uint16_t brightness, uint32_t duration = 0);
+    void SetColorByGroup(char *group, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration = 0);
+    void SetColorByLabel(char *label, uint16_t hue, uint16_t saturation, uint16_t brightness, uint16_t kelvin, uint32_t duration = 0);
+    void SetPowerByGroup(char *group, uint16_t power);
+    void SetPowerByLabel(char *label, uint16_t power);
+    bool StateByGroup(char *group, lifx_gateway_reply *reply, uint16_t timeoutMsec = LIFX_GATEWAY_REPLY_TIMEOUT);
+    bool StateByLabel(char *label, lifx_gateway_reply *reply, uint16_t timeoutMsec = LIFX_GATEWAY_REPLY_TIMEOUT);
+  private:
+    void Send(uint8_t command, uint8_t target, const char *name);
+    bool State(uint8_t target, const char *name, lifx_gateway_reply *reply, uint16_t timeoutMsec);
+    LifxUdp _udp;
+    IPAddress _gateway;
+    uint16_t _port = LIFX_GATEWAY_PORT;
+    uint8_t _sequence = 0;
+    lifx_gateway_request _request;
+};
+
+
+#endif // _LIFX_GATEWAY_
@@ -0,0 +1,211 @@
+/************************************************************************/
+/* Linux host transport for the Lifx library.  Build with LIFX_HOST_UDP */
+/* defined to use it in place of WiFiUDP.  It provides the WiFiUDP      */
+/* calls Lifx uses plus batched send and receive with sendmmsg and      */
+/* recvmmsg so a fan-out to many bulbs or a burst of replies costs one  */
+/* system call instead of one per datagram.                             */
+/************************************************************************/
+#include "LifxHostUdp.h"
+#if defined(LIFX_HOST_UDP)
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+LifxHostUdp::~LifxHostUdp()
+{
+  stop();
+}
+
+uint8_t LifxHostUdp::begin(uint16_t port)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+
+  stop();
+  _fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (_fd < 0) return 0;
+
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(_fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+  fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+  {
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+void LifxHostUdp::stop()
+{
+  if (_fd >= 0) close(_fd);
+  _fd = -1;
+}
+
+int LifxHostUdp::parsePacket()
+{
+  struct sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+
+  _rxLen = 0;
+  if (_fd < 0) return 0;
+  int n = recvfrom(_fd, _rxBuffer, sizeof(_rxBuffer), MSG_DONTWAIT, (struct sockaddr *) &addr, &addrLen);
+  if (n <= 0) return 0;
+
+  //  IPAddress holds the address in network byte order, as does s_addr
+  _rxLen = n;
+  _remoteIp = addr.sin_addr.s_addr;
+  _remotePort = ntohs(addr.sin_port);
+  return n;
+}
+
+int LifxHostUdp::read(uint8_t *buffer, size_t len)
+{
+  int n = ((size_t) _rxLen < len) ? _rxLen : len;
+  memcpy(buffer, _rxBuffer, n);
+  _rxLen = 0;
+  return n;
+}
+
+void LifxHostUdp::flush()
+{
+  _rxLen = 0;
+}
+
+IPAddress LifxHostUdp::remoteIP()
+{
+  return IPAddress(_remoteIp);
+}
+
+uint16_t LifxHostUdp::remotePort()
+{
+  return _remotePort;
+}
+
+int LifxHostUdp::beginPacket(IPAddress ipAddress, uint16_t port)
+{
+  _txIp = (uint32_t) ipAddress;
+  _txPort = port;
+  _txLen = 0;
+  return 1;
+}
+
+size_t LifxHostUdp::write(const uint8_t *buffer, size_t len)
+{
+  if (len > sizeof(_txBuffer) - _txLen) len = sizeof(_txBuffer) - _txLen;
+  memcpy(_txBuffer + _txLen, buffer, len);
+  _txLen += len;
+  return len;
+}
+
+int LifxHostUdp::endPacket()
+{
+  struct sockaddr_in addr;
+
+  if (_fd < 0) return 0;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = _txIp;
+  addr.sin_port = htons(_txPort);
+  return sendto(_fd, _txBuffer, _txLen, 0, (struct sockaddr *) &addr, sizeof(addr)) == _txLen;
+}
+
+int LifxHostUdp::SendBatch(const lifx_host_packet *packets, int count, uint16_t port, int *calls)
+{
+  //  sends count datagrams with as few sendmmsg calls as the kernel allows. returns the number sent. the
+  //  socket doesn't block, so when its buffer is full this waits up to LIFX_HOST_UDP_SEND_WAIT msec at a
+  //  time for room, LIFX_HOST_UDP_SEND_WAITS times in all. a datagram the kernel refuses outright is skipped
+  int sent = 0;
+  int done = 0;                 // Sent or skipped
+  int waits = 0;
+
+  *calls = 0;
+  if (_fd < 0) return 0;
+  while (done < count)
+  {
+    int n = count - done;
+    if (n > LIFX_HOST_UDP_BATCH_LEN) n = LIFX_HOST_UDP_BATCH_LEN;
+
+    memset(_msgs, 0, n * sizeof(struct mmsghdr));
+    for (int i = 0; i < n; i++)
+    {
+      const lifx_host_packet *p = &packets[done + i];
+      memset(&_addrs[i], 0, sizeof(struct sockaddr_in));
+      _addrs[i].sin_family = AF_INET;
+      _addrs[i].sin_addr.s_addr = p->ipAddress;
+      _addrs[i].sin_port = htons(port);
+      _iovs[i].iov_base = (void *) p->data;
+      _iovs[i].iov_len = p->len;
+      _msgs[i].msg_hdr.msg_name = &_addrs[i];
+      _msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      _msgs[i].msg_hdr.msg_iov = &_iovs[i];
+      _msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int r = sendmmsg(_fd, _msgs, n, 0);
+    (*calls)++;
+    if (r > 0)
+    {
+      sent += r;
+      done += r;
+    }
+    else if (r < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) && waits < LIFX_HOST_UDP_SEND_WAITS)
+    {
+      struct pollfd pfd = {_fd, POLLOUT, 0};
+      poll(&pfd, 1, LIFX_HOST_UDP_SEND_WAIT);
+      waits++;
+    }
+    else
+    {
+      done++;
+    }
+  }
+  return sent;
+}
+
+int LifxHostUdp::ReceiveBatch(lifx_host_packet *packets, int count)
+{
+  //  reads up to count waiting datagrams with one recvmmsg call without blocking. returns the number read
+
+  if (_fd < 0) return 0;
+  if (count > LIFX_HOST_UDP_BATCH_LEN) count = LIFX_HOST_UDP_BATCH_LEN;
+
+  memset(_msgs, 0, count * sizeof(struct mmsghdr));
+  for (int i = 0; i < count; i++)
+  {
+    _iovs[i].iov_base = packets[i].data;
+    _iovs[i].iov_len = sizeof(packets[i].data);
+    _msgs[i].msg_hdr.msg_name = &_addrs[i];
+    _msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    _msgs[i].msg_hdr.msg_iov = &_iovs[i];
+    _msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int n = recvmmsg(_fd, _msgs, count, MSG_DONTWAIT, NULL);
+  if (n <= 0) return 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    packets[i].len = _msgs[i].msg_len;
+    packets[i].ipAddress = _addrs[i].sin_addr.s_addr;
+  }
+  return n;
+}
+
+
+#endif // LIFX_HOST_UDP
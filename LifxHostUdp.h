@@ -0,0 +1,64 @@
+/************************************************************************/
+/* Linux host transport for the Lifx library.  Build with LIFX_HOST_UDP */
+/* defined to use it in place of WiFiUDP.  It provides the WiFiUDP      */
+/* calls Lifx uses plus batched send and receive with sendmmsg and      */
+/* recvmmsg so a fan-out to many bulbs or a burst of replies costs one  */
+/* system call instead of one per datagram.                             */
+/************************************************************************/
+#ifndef _LIFX_HOST_UDP_
+#define _LIFX_HOST_UDP_
+#if defined(LIFX_HOST_UDP)
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <Arduino.h>
+
+
+#define LIFX_HOST_UDP_BATCH_LEN 64        // Most datagrams moved by one sendmmsg or recvmmsg
+#define LIFX_HOST_UDP_PACKET_LEN 300      // Largest datagram received
+#define LIFX_HOST_UDP_SEND_WAIT 5         // Msec to wait for room in a full socket buffer
+#define LIFX_HOST_UDP_SEND_WAITS 4        // Waits per SendBatch before datagrams are dropped
+
+
+// One datagram, data first so the buffers are aligned
+typedef struct {
+  uint8_t data[LIFX_HOST_UDP_PACKET_LEN];
+  uint16_t len;
+  uint32_t ipAddress;
+} lifx_host_packet;
+
+
+class LifxHostUdp
+{
+  public:
+    ~LifxHostUdp();
+    uint8_t begin(uint16_t port);
+    void stop();
+    int parsePacket();
+    int read(uint8_t *buffer, size_t len);
+    void flush();
+    IPAddress remoteIP();
+    uint16_t remotePort();
+    int beginPacket(IPAddress ipAddress, uint16_t port);
+    size_t write(const uint8_t *buffer, size_t len);
+    int endPacket();
+    int SendBatch(const lifx_host_packet *packets, int count, uint16_t port, int *calls);
+    int ReceiveBatch(lifx_host_packet *packets, int count);
+  private:
+    int _fd = -1;
+    uint8_t _rxBuffer[LIFX_HOST_UDP_PACKET_LEN];
+    int _rxLen = 0;
+    uint32_t _remoteIp = 0;
+    uint16_t _remotePort = 0;
+    uint8_t _txBuffer[LIFX_HOST_UDP_PACKET_LEN];
+    int _txLen = 0;
+    uint32_t _txIp = 0;
+    uint16_t _txPort = 0;
+    struct mmsghdr _msgs[LIFX_HOST_UDP_BATCH_LEN];      // sendmmsg and recvmmsg arguments, per instance so
+    struct iovec _iovs[LIFX_HOST_UDP_BATCH_LEN];        // separate instances can run on separate threads
+    struct sockaddr_in _addrs[LIFX_HOST_UDP_BATCH_LEN];
+};
+
+
+#endif // LIFX_HOST_UDP
+#endif // _LIFX_HOST_UDP_
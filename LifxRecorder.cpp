@@ -0,0 +1,220 @@
+/************************************************************************/
+/* Packet capture and replay for the Lifx library.  LifxRecorder logs   */
+/* every datagram sent and received by a Lifx instance with a timestamp */
+/* and peer address, either into a ring buffer or straight out to a     */
+/* Print (file, Serial).  LifxReplay feeds a recorded session back into */
+/* a Lifx instance on a virtual clock, as fast as the CPU allows.       */
+/************************************************************************/
+#include "Lifx.h"
+#include "LifxRecorder.h"
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+LifxRecorder::LifxRecorder(uint8_t *buffer, uint32_t bufferLen)
+{
+  //  records are kept in the caller's buffer, the oldest are dropped when it fills
+  _buffer = buffer;
+  _bufferLen = bufferLen;
+}
+
+LifxRecorder::LifxRecorder(Print &out)
+{
+  //  records are written out as they happen
+  _out = &out;
+}
+
+void LifxRecorder::Record(uint8_t direction, uint32_t msec, uint32_t ipAddress, const uint8_t *data, uint16_t len)
+{
+  lifx_record_header rec;
+  uint32_t recLen = sizeof(lifx_record_header) + len;
+
+  rec.msec = msec;
+  rec.ipAddress = ipAddress;
+  rec.len = len;
+  rec.direction = direction;
+
+  if (_out != NULL)
+  {
+    if (!_sessionStarted)
+    {
+      lifx_session_header session = {LIFX_RECORD_MAGIC, LIFX_RECORD_VERSION, 0};
+      _out->write((const uint8_t *) &session, sizeof(session));
+      _sessionStarted = true;
+    }
+    _out->write((const uint8_t *) &rec, sizeof(rec));
+    _out->write(data, len);
+    _records++;
+    return;
+  }
+
+  if (recLen > _bufferLen)
+  {
+    _dropped++;
+    return;
+  }
+
+  //  make room by dropping whole records from the tail
+  while ((_bufferLen - _used) < recLen)
+  {
+    lifx_record_header old;
+    Get(_tail, (uint8_t *) &old, sizeof(old));
+    _tail = (_tail + sizeof(old) + old.len) % _bufferLen;
+    _used -= sizeof(old) + old.len;
+    _records--;
+    _dropped++;
+  }
+
+  Put((const uint8_t *) &rec, sizeof(rec));
+  Put(data, len);
+  _records++;
+}
+
+uint32_t LifxRecorder::Dump(Print &out)
+{
+  //  writes the buffered session oldest record first, in the same format the Print constructor produces
+  lifx_session_header session = {LIFX_RECORD_MAGIC, LIFX_RECORD_VERSION, 0};
+  uint32_t first = _used;
+
+  if (_buffer == NULL) return 0;
+  out.write((const uint8_t *) &session, sizeof(session));
+  if (_tail + first > _bufferLen) first = _bufferLen - _tail;
+  out.write(_buffer + _tail, first);
+  if (first < _used) out.write(_buffer, _used - first);
+  return sizeof(session) + _used;
+}
+
+void LifxRecorder::Clear()
+{
+  _head = 0;
+  _tail = 0;
+  _used = 0;
+  _records = 0;
+  _dropped = 0;
+}
+
+uint32_t LifxRecorder::Records()
+{
+  return _records;
+}
+
+uint32_t LifxRecorder::Dropped()
+{
+  return _dropped;
+}
+
+void LifxRecorder::Put(const uint8_t *data, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++)
+  {
+    _buffer[_head] = data[i];
+    if (++_head == _bufferLen) _head = 0;
+  }
+  _used += len;
+}
+
+void LifxRecorder::Get(uint32_t pos, uint8_t *data, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++)
+  {
+    data[i] = _buffer[pos];
+    if (++pos == _bufferLen) pos = 0;
+  }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+unsigned long LifxReplay::_virtualMsec = 0;
+
+LifxReplay::LifxReplay(Lifx &lifx, const uint8_t *session, uint32_t sessionLen) :
+  _lifx(lifx),
+  _session(session),
+  _sessionLen(sessionLen)
+{
+}
+
+unsigned long LifxReplay::VirtualMillis()
+{
+  return _virtualMsec;
+}
+
+bool LifxReplay::Run(lifx_replay_stats *stats, uint16_t tickMsec, bool startDiscovery)
+{
+  //  received datagrams are fed to the Lifx instance at their recorded times. in between the virtual clock
+  //  advances in tickMsec steps with the Lifx timers serviced at each step as loop() would be, but without
+  //  waiting. transmit is disabled so the replayed instance stays off the network. the virtual clock is
+  //  installed before anything else happens and discovery is started wherever the recorded instance started
+  //  it, so the replayed discovery meets the recorded replies at the same points. startDiscovery starts it
+  //  at the first record as well, for sessions that began before StartDiscovery was called
+  lifx_session_header session;
+  lifx_record_header rec;
+  byte packet[LIFX_INCOMING_PACKET_BUFFER_LEN];
+  uint32_t pos = sizeof(session);
+  unsigned long startMicros = micros();
+  lifx_transport_stats transportStart;
+  lifx_transport_stats transportEnd;
+
+  memset(stats, 0, sizeof(lifx_replay_stats));
+  if (_sessionLen < sizeof(session)) return false;
+  memcpy(&session, _session, sizeof(session));
+  if (session.magic != LIFX_RECORD_MAGIC || session.version < 1 || session.version > LIFX_RECORD_VERSION) return false;
+  if (tickMsec == 0) tickMsec = 1;
+
+  _virtualMsec = 0;
+  if ((pos + sizeof(rec)) <= _sessionLen)
+  {
+    memcpy(&rec, _session + pos, sizeof(rec));
+    _virtualMsec = rec.msec;
+  }
+  stats->virtualMsec = _virtualMsec;
+
+  _lifx.SetClock(VirtualMillis);
+  _lifx.SetTransmitEnable(false);
+  _lifx.GetTransportStats(&transportStart);
+  if (startDiscovery) _lifx.StartDiscovery();
+
+  while ((pos + sizeof(rec)) <= _sessionLen)
+  {
+    memcpy(&rec, _session + pos, sizeof(rec));
+    pos += sizeof(rec);
+    if ((pos + rec.len) > _sessionLen) break;     // truncated session
+
+    while ((long) (rec.msec - _virtualMsec) > tickMsec)
+    {
+      _virtualMsec += tickMsec;
+      _lifx.ServiceTimers();
+    }
+    _virtualMsec = rec.msec;
+
+    if (rec.direction == LIFX_RECORD_RX)
+    {
+      if (rec.len >= sizeof(lifx_header) && rec.len < LIFX_INCOMING_PACKET_BUFFER_LEN)
+      {
+        memcpy(packet, _session + pos, rec.len);
+        _lifx.ReceivedMessage(packet, rec.len, IPAddress(rec.ipAddress));
+        stats->rxPackets++;
+      }
+    }
+    else if (rec.direction == LIFX_RECORD_TX)
+    {
+      stats->txPackets++;
+    }
+    else if (rec.direction == LIFX_RECORD_DISCOVERY)
+    {
+      _lifx.StartDiscovery();
+    }
+    _lifx.ServiceTimers();
+
+    pos += rec.len;
+    stats->records++;
+  }
+
+  stats->virtualMsec = _virtualMsec - stats->virtualMsec;
+  stats->realMicros = micros() - startMicros;
+  _lifx.GetTransportStats(&transportEnd);
+  stats->replayTxPackets = transportEnd.txPackets - transportStart.txPackets;
+  stats->replayTxCalls = transportEnd.txCalls - transportStart.txCalls;
+
+  _lifx.SetTransmitEnable(true);
+  _lifx.SetClock(NULL);
+  return true;
+}
@@ -0,0 +1,95 @@
+/************************************************************************/
+/* Packet capture and replay for the Lifx library.  LifxRecorder logs   */
+/* every datagram sent and received by a Lifx instance with a timestamp */
+/* and peer address, either into a ring buffer or straight out to a     */
+/* Print (file, Serial).  LifxReplay feeds a recorded session back into */
+/* a Lifx instance on a virtual clock, as fast as the CPU allows.       */
+/************************************************************************/
+#ifndef _LIFX_RECORDER_
+#define _LIFX_RECORDER_
+#include <stdint.h>
+#include <Arduino.h>
+
+
+#define LIFX_RECORD_MAGIC   0x5846494C     // "LIFX" at the start of a session
+#define LIFX_RECORD_VERSION 2              // 2 adds LIFX_RECORD_DISCOVERY
+
+// Record directions
+#define LIFX_RECORD_RX 0
+#define LIFX_RECORD_TX 1
+#define LIFX_RECORD_DISCOVERY 2         // StartDiscovery was called, no datagram
+
+// Session header, written once before the first record
+#pragma pack(push, 1)
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+} lifx_session_header;
+#pragma pack(pop)
+
+// Record header, followed by len bytes of datagram
+#pragma pack(push, 1)
+typedef struct {
+  uint32_t msec;          // Lifx clock when the datagram was sent or received
+  uint32_t ipAddress;     // Peer address
+  uint16_t len;
+  uint8_t  direction;
+} lifx_record_header;
+#pragma pack(pop)
+
+// Replay results
+typedef struct {
+  uint32_t records;
+  uint32_t rxPackets;           // Datagrams fed to the Lifx instance
+  uint32_t txPackets;           // Datagrams the recorded instance sent (not replayed)
+  uint32_t replayTxPackets;     // Datagrams the replayed instance would have sent
+  uint32_t replayTxCalls;       // Transport send calls they would have taken (estimated)
+  uint32_t virtualMsec;         // Length of the session on the virtual clock
+  uint32_t realMicros;          // Time the replay took
+} lifx_replay_stats;
+
+
+class Lifx;
+
+
+class LifxRecorder
+{
+  public:
+    LifxRecorder(uint8_t *buffer, uint32_t bufferLen);
+    LifxRecorder(Print &out);
+    void Record(uint8_t direction, uint32_t msec, uint32_t ipAddress, const uint8_t *data, uint16_t len);
+    uint32_t Dump(Print &out);
+    void Clear();
+    uint32_t Records();
+    uint32_t Dropped();
+  private:
+    void Put(const uint8_t *data, uint32_t len);
+    void Get(uint32_t pos, uint8_t *data, uint32_t len);
+    uint8_t *_buffer = NULL;
+    uint32_t _bufferLen = 0;
+    uint32_t _head = 0;           // Next byte to write
+    uint32_t _tail = 0;           // Oldest record
+    uint32_t _used = 0;
+    Print *_out = NULL;
+    bool _sessionStarted = false;
+    uint32_t _records = 0;
+    uint32_t _dropped = 0;
+};
+
+
+class LifxReplay
+{
+  public:
+    LifxReplay(Lifx &lifx, const uint8_t *session, uint32_t sessionLen);
+    bool Run(lifx_replay_stats *stats, uint16_t tickMsec = 10, bool startDiscovery = false);
+    static unsigned long VirtualMillis();
+  private:
+    Lifx &_lifx;
+    const uint8_t *_session;
+    uint32_t _sessionLen;
+    static unsigned long _virtualMsec;
+};
+
+
+#endif // _LIFX_RECORDER_
@@ -0,0 +1,267 @@
+/************************************************************************/
+/* Device selectors for the Lifx library.  A selector describes a set   */
+/* of devices by label, group, location or product capability and is   */
+/* compiled by Lifx into a membership bitset over its device table that */
+/* is kept up to date as devices report new metadata.                   */
+/************************************************************************/
+#include <ctype.h>
+#include "Lifx.h"
+#include "LifxSelector.h"
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void LifxDeviceSet::Set(uint16_t n)
+{
+  if ((n >> 5) >= _bits.size()) _bits.resize((n >> 5) + 1, 0);
+  _bits[n >> 5] |= (1UL << (n & 31));
+}
+
+void LifxDeviceSet::Clear(uint16_t n)
+{
+  if ((n >> 5) < _bits.size()) _bits[n >> 5] &= ~(1UL << (n & 31));
+}
+
+void LifxDeviceSet::Assign(uint16_t n, bool member)
+{
+  if (member)
+    Set(n);
+  else
+    Clear(n);
+}
+
+bool LifxDeviceSet::Test(uint16_t n) const
+{
+  if ((n >> 5) >= _bits.size()) return false;
+  return (_bits[n >> 5] >> (n & 31)) & 1;
+}
+
+void LifxDeviceSet::ClearAll()
+{
+  _bits.clear();
+}
+
+uint16_t LifxDeviceSet::Count() const
+{
+  uint16_t count = 0;
+  for (uint32_t w: _bits) count += __builtin_popcount(w);
+  return count;
+}
+
+int LifxDeviceSet::Next(int n, const LifxDeviceSet *exclude) const
+{
+  uint16_t w = n >> 5;
+  if (n < 0 || w >= _bits.size()) return -1;
+
+  //  mask off members below n in the first word, then skip empty words
+  uint32_t bits = _bits[w] & (0xFFFFFFFFUL << (n & 31));
+  if (exclude != NULL) bits &= ~exclude->Word(w);
+  while (bits == 0)
+  {
+    if (++w >= _bits.size()) return -1;
+    bits = _bits[w];
+    if (exclude != NULL) bits &= ~exclude->Word(w);
+  }
+  return (w << 5) + __builtin_ctz(bits);
+}
+
+uint16_t LifxDeviceSet::Words() const
+{
+  return _bits.size();
+}
+
+uint32_t LifxDeviceSet::Word(uint16_t w) const
+{
+  return (w < _bits.size()) ? _bits[w] : 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static bool lifx_pattern_match(const char *pattern, const char *s, uint8_t flags)
+{
+  //  pattern is NUL terminated, s is a LIFX label field that may fill all 32 bytes without a NUL
+  for (int i = 0; i < LIFX_SELECTOR_PATTERN_LEN; i++)
+  {
+    char p = pattern[i];
+    char c = s[i];
+
+    if (p == '*' && pattern[i + 1] == 0 && !(flags & LIFX_MATCH_LITERAL)) return true;
+    if (flags & LIFX_MATCH_NOCASE)
+    {
+      p = tolower((unsigned char) p);
+      c = tolower((unsigned char) c);
+    }
+    if (p != c) return false;
+    if (p == 0) return true;
+  }
+  return true;
+}
+
+LifxSelector LifxSelector::Term(uint8_t op, const char *pattern, uint8_t flags, const uint8_t *id, uint8_t arg)
+{
+  lifx_selector_term t;
+  LifxSelector sel;
+
+  memset(&t, 0, sizeof(t));
+  t.op = op;
+  t.flags = flags;
+  t.arg = arg;
+  if (pattern != NULL) strncpy(t.pattern, pattern, LIFX_SELECTOR_PATTERN_LEN);
+  if (id != NULL) memcpy(t.id, id, LIFX_ID_LEN);
+  sel._terms.push_back(t);
+  return sel;
+}
+
+LifxSelector LifxSelector::Combine(const LifxSelector &other, uint8_t op) const
+{
+  LifxSelector sel = *this;
+
+  sel._terms.insert(sel._terms.end(), other._terms.begin(), other._terms.end());
+  sel._terms.push_back(Term(op, NULL, 0, NULL, 0)._terms[0]);
+  return sel;
+}
+
+LifxSelector LifxSelector::All()
+{
+  return Term(LIFX_SEL_ALL, NULL, 0, NULL, 0);
+}
+
+LifxSelector LifxSelector::Label(const char *pattern, uint8_t flags)
+{
+  return Term(LIFX_SEL_LABEL, pattern, flags, NULL, 0);
+}
+
+LifxSelector LifxSelector::Group(const char *pattern, uint8_t flags)
+{
+  return Term(LIFX_SEL_GROUP, pattern, flags, NULL, 0);
+}
+
+LifxSelector LifxSelector::GroupId(const uint8_t id[LIFX_ID_LEN])
+{
+  return Term(LIFX_SEL_GROUP_ID, NULL, 0, id, 0);
+}
+
+LifxSelector LifxSelector::Location(const char *pattern, uint8_t flags)
+{
+  return Term(LIFX_SEL_LOCATION, pattern, flags, NULL, 0);
+}
+
+LifxSelector LifxSelector::LocationId(const uint8_t id[LIFX_ID_LEN])
+{
+  return Term(LIFX_SEL_LOCATION_ID, NULL, 0, id, 0);
+}
+
+LifxSelector LifxSelector::LightType(lifx_light_type type)
+{
+  return Term(LIFX_SEL_LIGHT_TYPE, NULL, 0, NULL, type);
+}
+
+LifxSelector LifxSelector::Zones(lifx_zone_type zones)
+{
+  return Term(LIFX_SEL_ZONES, NULL, 0, NULL, zones);
+}
+
+LifxSelector LifxSelector::Infrared()
+{
+  return Term(LIFX_SEL_INFRARED, NULL, 0, NULL, 0);
+}
+
+LifxSelector LifxSelector::Hev()
+{
+  return Term(LIFX_SEL_HEV, NULL, 0, NULL, 0);
+}
+
+LifxSelector LifxSelector::And(const LifxSelector &other) const
+{
+  return Combine(other, LIFX_SEL_AND);
+}
+
+LifxSelector LifxSelector::Or(const LifxSelector &other) const
+{
+  return Combine(other, LIFX_SEL_OR);
+}
+
+LifxSelector LifxSelector::Not() const
+{
+  LifxSelector sel = *this;
+
+  sel._terms.push_back(Term(LIFX_SEL_NOT, NULL, 0, NULL, 0)._terms[0]);
+  return sel;
+}
+
+bool LifxSelector::Matches(Device *dev) const
+{
+  //  terms are in postfix order so the evaluation stack is a word of bits, top of stack in bit 0
+  uint32_t stack = 0;
+  int depth = 0;
+  int i = lifx_find_pid_index(dev->Product);
+  bool m;
+
+  for (const lifx_selector_term &t: _terms)
+  {
+    switch (t.op)
+    {
+      case LIFX_SEL_AND:
+        m = (stack & 1) && (stack & 2);
+        stack >>= 2;
+        depth -= 2;
+        break;
+
+      case LIFX_SEL_OR:
+        m = (stack & 1) || (stack & 2);
+        stack >>= 2;
+        depth -= 2;
+        break;
+
+      case LIFX_SEL_NOT:
+        m = !(stack & 1);
+        stack >>= 1;
+        depth -= 1;
+        break;
+
+      case LIFX_SEL_LABEL:
+        m = lifx_pattern_match(t.pattern, dev->Label, t.flags);
+        break;
+
+      case LIFX_SEL_GROUP:
+        m = lifx_pattern_match(t.pattern, dev->Group, t.flags);
+        break;
+
+      case LIFX_SEL_GROUP_ID:
+        m = memcmp(t.id, dev->GroupId, LIFX_ID_LEN) == 0;
+        break;
+
+      case LIFX_SEL_LOCATION:
+        m = lifx_pattern_match(t.pattern, dev->Location, t.flags);
+        break;
+
+      case LIFX_SEL_LOCATION_ID:
+        m = memcmp(t.id, dev->LocationId, LIFX_ID_LEN) == 0;
+        break;
+
+      case LIFX_SEL_LIGHT_TYPE:
+        m = (i >= 0) && (lifx_types[i].color == t.arg);
+        break;
+
+      case LIFX_SEL_ZONES:
+        m = (i >= 0) && (lifx_types[i].zones == t.arg);
+        break;
+
+      case LIFX_SEL_INFRARED:
+        m = (i >= 0) && lifx_types[i].infrared;
+        break;
+
+      case LIFX_SEL_HEV:
+        m = (i >= 0) && lifx_types[i].hev;
+        break;
+
+      default:
+        m = true;
+        break;
+    }
+
+    if (depth < 0 || depth >= 32) return false;   // malformed or too deep
+    stack = (stack << 1) | (m ? 1 : 0);
+    depth++;
+  }
+  return (depth == 1) && (stack & 1);
+}
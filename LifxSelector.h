@@ -0,0 +1,94 @@
+/************************************************************************/
+/* Device selectors for the Lifx library.  A selector describes a set   */
+/* of devices by label, group, location or product capability and is   */
+/* compiled by Lifx into a membership bitset over its device table that */
+/* is kept up to date as devices report new metadata.                   */
+/************************************************************************/
+#ifndef _LIFX_SELECTOR_
+#define _LIFX_SELECTOR_
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "LifxProducts.h"
+
+
+#define LIFX_ID_LEN 16                 // Length in bytes of group and location UUIDs
+#define LIFX_SELECTOR_PATTERN_LEN 32   // Longest label pattern (same as the LIFX label fields)
+
+// Pattern match flags
+#define LIFX_MATCH_EXACT  0x00
+#define LIFX_MATCH_NOCASE 0x01         // Case insensitive compare
+#define LIFX_MATCH_LITERAL 0x02        // A trailing '*' is matched as itself, as the ByLabel and ByGroup methods do
+
+// Selector term operations (evaluated in postfix order)
+typedef enum {
+  LIFX_SEL_ALL,
+  LIFX_SEL_LABEL,
+  LIFX_SEL_GROUP,
+  LIFX_SEL_GROUP_ID,
+  LIFX_SEL_LOCATION,
+  LIFX_SEL_LOCATION_ID,
+  LIFX_SEL_LIGHT_TYPE,
+  LIFX_SEL_ZONES,
+  LIFX_SEL_INFRARED,
+  LIFX_SEL_HEV,
+  LIFX_SEL_AND,
+  LIFX_SEL_OR,
+  LIFX_SEL_NOT
+} lifx_selector_op;
+
+typedef struct {
+  uint8_t op;
+  uint8_t flags;
+  uint8_t arg;                                  // lifx_light_type or lifx_zone_type
+  uint8_t id[LIFX_ID_LEN];
+  char pattern[LIFX_SELECTOR_PATTERN_LEN + 1];  // A trailing '*' makes this a prefix match unless LIFX_MATCH_LITERAL
+} lifx_selector_term;
+
+
+class Device;
+
+
+// One bit per slot in the Lifx device table
+class LifxDeviceSet
+{
+  public:
+    void Set(uint16_t n);
+    void Clear(uint16_t n);
+    void Assign(uint16_t n, bool member);
+    bool Test(uint16_t n) const;
+    void ClearAll();
+    uint16_t Count() const;
+    int Next(int n, const LifxDeviceSet *exclude = NULL) const;   // First member at or after n not in exclude, -1 if none
+    uint16_t Words() const;
+    uint32_t Word(uint16_t w) const;
+  private:
+    std::vector<uint32_t> _bits;
+};
+
+
+class LifxSelector
+{
+  public:
+    static LifxSelector All();
+    static LifxSelector Label(const char *pattern, uint8_t flags = LIFX_MATCH_EXACT);
+    static LifxSelector Group(const char *pattern, uint8_t flags = LIFX_MATCH_EXACT);
+    static LifxSelector GroupId(const uint8_t id[LIFX_ID_LEN]);
+    static LifxSelector Location(const char *pattern, uint8_t flags = LIFX_MATCH_EXACT);
+    static LifxSelector LocationId(const uint8_t id[LIFX_ID_LEN]);
+    static LifxSelector LightType(lifx_light_type type);
+    static LifxSelector Zones(lifx_zone_type zones);
+    static LifxSelector Infrared();
+    static LifxSelector Hev();
+    LifxSelector And(const LifxSelector &other) const;
+    LifxSelector Or(const LifxSelector &other) const;
+    LifxSelector Not() const;
+    bool Matches(Device *dev) const;
+  private:
+    static LifxSelector Term(uint8_t op, const char *pattern, uint8_t flags, const uint8_t *id, uint8_t arg);
+    LifxSelector Combine(const LifxSelector &other, uint8_t op) const;
+    std::vector<lifx_selector_term> _terms;
+};
+
+
+#endif // _LIFX_SELECTOR_
@@ -0,0 +1,89 @@
+#include "Lifx.h"
+
+//  LIFX
+Lifx lifx;
+
+//  CAPTURE
+//    Every datagram sent or received is logged to this ring buffer.  Send 'd' on the serial port to dump
+//    the session in binary (save it to a file to replay it on a host), or 'r' to replay it here into a
+//    second Lifx instance on a virtual clock.
+uint8_t captureBuffer[32768];
+LifxRecorder recorder(captureBuffer, sizeof(captureBuffer));
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void setup() {
+
+  Serial.begin(115200);
+  delay(10);
+
+  // WIFI connection
+  Serial.println("Connecting Wifi...");
+  WiFi.begin("YOUR_SSID","YOUR_PASSWORD");
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(500);
+  }
+  WiFi.setAutoReconnect(true);
+  WiFi.persistent(true);
+  Serial.print("IP address: ");
+  Serial.println(WiFi.localIP());
+  lifx.begin();
+  lifx.SetRecorder(&recorder);
+
+  // LIFX CALLBACK AND DISCOVERY
+  lifx.DiscoveryCompleteCallback(DiscoveryComplete);
+  lifx.StartDiscovery();
+}
+
+void loop() {
+
+  lifx.loop();
+
+  if (Serial.available())
+  {
+    switch (Serial.read())
+    {
+      case 'd':
+        recorder.Dump(Serial);
+        break;
+
+      case 'r':
+        Replay();
+        break;
+    }
+  }
+}
+
+
+void DiscoveryComplete(Lifx& l)
+{
+  Serial.println("Discovery Complete");
+  Serial.printf("Device count: %i, %d packets recorded, %d dropped\n", l.DeviceCount(), recorder.Records(), recorder.Dropped());
+}
+
+
+void Replay()
+{
+  //  the replay instance keeps the devices it found between replays
+  static Lifx replayLifx;
+  static uint8_t session[sizeof(captureBuffer) + sizeof(lifx_session_header)];
+  class SessionWriter : public Print {
+    public:
+      uint32_t len = 0;
+      size_t write(uint8_t c) { session[len++] = c; return 1; }
+  } writer;
+  lifx_replay_stats stats;
+
+  //  stop recording while the capture is copied out of the ring buffer
+  lifx.SetRecorder(NULL);
+  recorder.Dump(writer);
+  lifx.SetRecorder(&recorder);
+
+  LifxReplay replay(replayLifx, session, writer.len);
+  if (replay.Run(&stats))
+  {
+    Serial.printf("Replayed %d records (%d rx, %d tx) covering %d ms in %d us\n", stats.records, stats.rxPackets, stats.txPackets, stats.virtualMsec, stats.realMicros);
+    Serial.printf("Replayed instance found %d devices\n", replayLifx.DeviceCount());
+    Serial.printf("Replayed instance sent %d packets in %d transport calls\n", stats.replayTxPackets, stats.replayTxCalls);
+  }
+}
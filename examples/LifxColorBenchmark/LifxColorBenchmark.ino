@@ -0,0 +1,215 @@
+#include "Lifx.h"
+
+//  Checks the fixed-point RGB888 and CIE 1931 xy to HSBK conversions against a floating point reference,
+//  the xy conversion also at known chromaticities, checks the kelvin conversion and reports how many pixels
+//  per second the RGB and xy conversions manage.  No WiFi needed.
+
+#define CHUNK 256
+#define GRID_STEP 3
+#define BENCH_PIXELS 1024
+#define BENCH_PASSES 100
+#define XY_GRID 100
+
+uint8_t rgb[3 * BENCH_PIXELS];
+uint16_t xy[2 * BENCH_PIXELS];
+uint16_t brightness[BENCH_PIXELS];
+lifx_hsbk hsbk[BENCH_PIXELS];
+
+//  D65 white and the sRGB primaries, with the hue and saturation they should give
+struct {
+  const char *name;
+  float x, y;
+  uint16_t hue, saturation;
+} knownXy[] = {
+  {"D65", 0.3127f, 0.3290f, 0, 0},
+  {"red", 0.64f, 0.33f, 0, 65535},
+  {"green", 0.30f, 0.60f, 21845, 65535},
+  {"blue", 0.15f, 0.06f, 43691, 65535},
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void setup() {
+
+  Serial.begin(115200);
+  delay(10);
+
+  CheckAccuracy();
+  CheckXyAccuracy();
+  CheckKelvin();
+  Benchmark();
+}
+
+void loop() {
+}
+
+
+void ReferenceHsbk(int r, int g, int b, float *h, float *s, float *v)
+{
+  float mx = max(r, max(g, b));
+  float mn = min(r, min(g, b));
+  float d = mx - mn;
+  float hh;
+
+  *v = mx / 255.0f * 65535.0f;
+  *s = (mx == 0) ? 0 : d / mx * 65535.0f;
+  if (d == 0) hh = 0;
+  else if (mx == r) hh = fmodf((g - b) / d + 6.0f, 6.0f);
+  else if (mx == g) hh = (b - r) / d + 2.0f;
+  else hh = (r - g) / d + 4.0f;
+  *h = hh / 6.0f * 65536.0f;
+}
+
+
+void CheckAccuracy()
+{
+  float maxHue = 0, maxSat = 0, maxBri = 0;
+  uint32_t pixels = 0;
+  int n = 0;
+
+  for (int r = 0; r < 256; r += GRID_STEP)
+  {
+    for (int g = 0; g < 256; g += GRID_STEP)
+    {
+      for (int b = 0; b < 256; b += GRID_STEP)
+      {
+        rgb[3 * n] = r;
+        rgb[3 * n + 1] = g;
+        rgb[3 * n + 2] = b;
+        if (++n < CHUNK && !(r + GRID_STEP > 255 && g + GRID_STEP > 255 && b + GRID_STEP > 255)) continue;
+
+        lifx_rgb888_to_hsbk(rgb, hsbk, n, 3500);
+        for (int i = 0; i < n; i++)
+        {
+          float h, s, v, dh;
+          ReferenceHsbk(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2], &h, &s, &v);
+          dh = fabsf(h - hsbk[i].hue);
+          if (dh > 32768) dh = 65536 - dh;
+          maxHue = max(maxHue, dh);
+          maxSat = max(maxSat, fabsf(s - hsbk[i].saturation));
+          maxBri = max(maxBri, fabsf(v - hsbk[i].brightness));
+        }
+        pixels += n;
+        n = 0;
+      }
+    }
+  }
+
+  Serial.printf("Checked %d pixels, max error hue %.2f, saturation %.2f, brightness %.2f (of 65535)\n", pixels, maxHue, maxSat, maxBri);
+}
+
+
+float Gamma(float c)
+{
+  return (c <= 0.0031308f) ? (12.92f * c) : (1.055f * powf(c, 1.0f / 2.4f) - 0.055f);
+}
+
+
+void ReferenceXy(float x, float y, float *h, float *s)
+{
+  //  xy to linear sRGB with Y = y, clipped to the gamut, scaled to full scale and gamma encoded
+  float z = max(0.0f, 1.0f - x - y);
+  float r = max(0.0f, 3.2406f * x - 1.5372f * y - 0.4986f * z);
+  float g = max(0.0f, -0.9689f * x + 1.8758f * y + 0.0415f * z);
+  float b = max(0.0f, 0.0557f * x - 0.2040f * y + 1.0570f * z);
+  float mx = max(r, max(g, b));
+  float v;
+
+  if (mx <= 0)
+  {
+    *h = *s = 0;
+    return;
+  }
+  ReferenceHsbk(Gamma(r / mx) * 255.0f, Gamma(g / mx) * 255.0f, Gamma(b / mx) * 255.0f, h, s, &v);
+}
+
+
+void CheckXyAccuracy()
+{
+  //  hue is meaningless near white so its error is weighted by saturation
+  float maxHue = 0, maxSat = 0;
+  uint32_t pixels = 0;
+  int n = 0;
+
+  for (int i = 0; i < (int) (sizeof(knownXy) / sizeof(knownXy[0])); i++)
+  {
+    xy[2 * i] = knownXy[i].x * 65535.0f + 0.5f;
+    xy[2 * i + 1] = knownXy[i].y * 65535.0f + 0.5f;
+    brightness[i] = 65535;
+  }
+  lifx_xy_to_hsbk(xy, brightness, hsbk, sizeof(knownXy) / sizeof(knownXy[0]), 3500);
+  for (int i = 0; i < (int) (sizeof(knownXy) / sizeof(knownXy[0])); i++)
+  {
+    Serial.printf("xy %s: hue %u (expect %u), saturation %u (expect %u)\n", knownXy[i].name, hsbk[i].hue, knownXy[i].hue, hsbk[i].saturation, knownXy[i].saturation);
+  }
+
+  for (int i = 1; i < XY_GRID; i++)
+  {
+    for (int j = 1; i + j < XY_GRID; j++)
+    {
+      xy[2 * n] = i * 65535L / XY_GRID;
+      xy[2 * n + 1] = j * 65535L / XY_GRID;
+      brightness[n] = 65535;
+      if (++n < CHUNK && !(i == XY_GRID - 2 && j == 1)) continue;
+
+      lifx_xy_to_hsbk(xy, brightness, hsbk, n, 3500);
+      for (int k = 0; k < n; k++)
+      {
+        float h, s, dh;
+        ReferenceXy(xy[2 * k] / 65535.0f, xy[2 * k + 1] / 65535.0f, &h, &s);
+        dh = fabsf(h - hsbk[k].hue);
+        if (dh > 32768) dh = 65536 - dh;
+        maxHue = max(maxHue, dh * s / 65535.0f);
+        maxSat = max(maxSat, fabsf(s - hsbk[k].saturation));
+      }
+      pixels += n;
+      n = 0;
+    }
+  }
+
+  Serial.printf("Checked %d xy points, max error hue (x saturation) %.2f, saturation %.2f (of 65535)\n", pixels, maxHue, maxSat);
+}
+
+
+void CheckKelvin()
+{
+  uint16_t kelvin[4] = {1000, 2700, 6500, 12000};
+  uint16_t expect[4] = {LIFX_KELVIN_MIN, 2700, 6500, LIFX_KELVIN_MAX};
+  int errors = 0;
+
+  for (int i = 0; i < 4; i++) brightness[i] = 1000 * i;
+  lifx_kelvin_to_hsbk(kelvin, brightness, hsbk, 4);
+  for (int i = 0; i < 4; i++)
+  {
+    if (hsbk[i].hue != 0 || hsbk[i].saturation != 0 || hsbk[i].brightness != brightness[i] || hsbk[i].kelvin != expect[i]) errors++;
+  }
+  Serial.printf("Kelvin check: %d errors\n", errors);
+}
+
+
+void Benchmark()
+{
+  unsigned long start;
+  unsigned long elapsed;
+
+  for (int i = 0; i < 3 * BENCH_PIXELS; i++) rgb[i] = random(256);
+
+  start = micros();
+  for (int i = 0; i < BENCH_PASSES; i++) lifx_rgb888_to_hsbk(rgb, hsbk, BENCH_PIXELS, 3500);
+  elapsed = micros() - start;
+
+  Serial.printf("Converted %d RGB pixels in %lu us, %.0f pixels/sec\n", BENCH_PIXELS * BENCH_PASSES, elapsed, (float) BENCH_PIXELS * BENCH_PASSES * 1000000.0f / elapsed);
+
+  for (int i = 0; i < BENCH_PIXELS; i++)
+  {
+    //  anywhere in the chromaticity diagram, in or out of gamut
+    xy[2 * i] = random(45000);
+    xy[2 * i + 1] = random(65535 - xy[2 * i]);
+    brightness[i] = random(65536);
+  }
+
+  start = micros();
+  for (int i = 0; i < BENCH_PASSES; i++) lifx_xy_to_hsbk(xy, brightness, hsbk, BENCH_PIXELS, 3500);
+  elapsed = micros() - start;
+
+  Serial.printf("Converted %d xy pixels in %lu us, %.0f pixels/sec\n", BENCH_PIXELS * BENCH_PASSES, elapsed, (float) BENCH_PIXELS * BENCH_PASSES * 1000000.0f / elapsed);
+}
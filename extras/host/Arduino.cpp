@@ -0,0 +1,99 @@
+/************************************************************************/
+/* Minimal Arduino core for building the Lifx library on a Linux host   */
+/* with LIFX_HOST_UDP defined.  It provides only what the library uses: */
+/* the timing and random functions, Print, Serial, String and           */
+/* IPAddress.                                                           */
+/************************************************************************/
+#include "Arduino.h"
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+
+HardwareSerial Serial;
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+unsigned long millis()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+unsigned long micros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void delay(unsigned long msec)
+{
+  usleep(msec * 1000);
+}
+
+long random(long howbig)
+{
+  //  Lifx asks for a full 32 bit source number
+  uint32_t r = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+  return (howbig > 0) ? (long) (r % (unsigned long) howbig) : 0;
+}
+
+void randomSeed(unsigned long seed)
+{
+  srand(seed);
+}
+
+int analogRead(uint8_t pin)
+{
+  //  there is no floating pin to seed from
+  return (int) micros();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t Print::write(const uint8_t *buffer, size_t len)
+{
+  size_t n = 0;
+  while (len--) n += write(*buffer++);
+  return n;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t len)
+{
+  return fwrite(buffer, 1, len, stdout);
+}
+
+size_t HardwareSerial::print(const char *s)
+{
+  return fputs(s, stdout) == EOF ? 0 : strlen(s);
+}
+
+size_t HardwareSerial::println(const char *s)
+{
+  return print(s) + print("\n");
+}
+
+size_t HardwareSerial::printf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int n = vprintf(format, args);
+  va_end(args);
+  return (n < 0) ? 0 : n;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+String IPAddress::toString() const
+{
+  char s[16];
+  snprintf(s, sizeof(s), "%u.%u.%u.%u", _address & 0xFF, (_address >> 8) & 0xFF, (_address >> 16) & 0xFF, _address >> 24);
+  return String(s);
+}
@@ -0,0 +1,79 @@
+/************************************************************************/
+/* Minimal Arduino core for building the Lifx library on a Linux host   */
+/* with LIFX_HOST_UDP defined.  It provides only what the library uses: */
+/* the timing and random functions, Print, Serial, String and           */
+/* IPAddress.                                                           */
+/************************************************************************/
+#ifndef _LIFX_HOST_ARDUINO_
+#define _LIFX_HOST_ARDUINO_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+
+#define A0 0
+
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long msec);
+long random(long howbig);
+void randomSeed(unsigned long seed);
+int analogRead(uint8_t pin);
+
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t len);
+};
+
+
+// Serial goes to stdout
+class HardwareSerial : public Print
+{
+  public:
+    void begin(unsigned long baud) {}
+    int available() { return 0; }
+    int read() { return -1; }
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t len);
+    size_t print(const char *s);
+    size_t println(const char *s = "");
+    size_t printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+};
+
+extern HardwareSerial Serial;
+
+
+class String
+{
+  public:
+    String(const char *s) : _s(s) {}
+    const char *c_str() const { return _s.c_str(); }
+  private:
+    std::string _s;
+};
+
+
+// Held in network byte order, as on the ESP cores
+class IPAddress
+{
+  public:
+    IPAddress() : _address(0) {}
+    IPAddress(uint32_t address) : _address(address) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address(a | (b << 8) | (c << 16) | ((uint32_t) d << 24)) {}
+    operator uint32_t() const { return _address; }
+    String toString() const;
+  private:
+    uint32_t _address;
+};
+
+
+#endif // _LIFX_HOST_ARDUINO_
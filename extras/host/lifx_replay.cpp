@@ -0,0 +1,121 @@
+/************************************************************************/
+/* Host capture and replay driver for the Lifx library.                 */
+/*                                                                      */
+/*   lifx_replay capture <file> [seconds]                               */
+/*     runs discovery on the local network and records the session      */
+/*   lifx_replay replay <file> [--discover] [tickMsec]                  */
+/*     replays a session, from here or dumped by the LifxCapture        */
+/*     example, on a virtual clock and prints the resulting devices     */
+/************************************************************************/
+#include "Lifx.h"
+
+
+// Writes a session to a file
+class FilePrint : public Print
+{
+  public:
+    FilePrint(FILE *f) : _f(f) {}
+    size_t write(uint8_t c) { return fputc(c, _f) == EOF ? 0 : 1; }
+    size_t write(const uint8_t *buffer, size_t len) { return fwrite(buffer, 1, len, _f); }
+  private:
+    FILE *_f;
+};
+
+
+static void DiscoveryComplete(Lifx &l)
+{
+  printf("Discovery complete, %d devices\n", l.DeviceCount());
+}
+
+static int Capture(const char *path, unsigned long seconds)
+{
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+
+  FilePrint out(f);
+  LifxRecorder recorder(out);
+  Lifx lifx;
+  unsigned long start = millis();
+
+  lifx.begin();
+  lifx.SetRecorder(&recorder);
+  lifx.DiscoveryCompleteCallback(DiscoveryComplete);
+  lifx.StartDiscovery();
+  while ((millis() - start) < seconds * 1000)
+  {
+    lifx.loop();
+    delay(1);
+  }
+  lifx.SetRecorder(NULL);
+  fclose(f);
+
+  lifx.PrintDevices();
+  printf("%u records written to %s\n", recorder.Records(), path);
+  return 0;
+}
+
+static int Replay(const char *path, bool startDiscovery, uint16_t tickMsec)
+{
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *session = (uint8_t *) malloc(len > 0 ? len : 1);
+  if (session == NULL || fread(session, 1, len, f) != (size_t) len)
+  {
+    fprintf(stderr, "%s: read failed\n", path);
+    fclose(f);
+    free(session);
+    return 1;
+  }
+  fclose(f);
+
+  Lifx lifx;
+  LifxReplay replay(lifx, session, len);
+  lifx_replay_stats stats;
+
+  lifx.DiscoveryCompleteCallback(DiscoveryComplete);
+  if (!replay.Run(&stats, tickMsec, startDiscovery))
+  {
+    fprintf(stderr, "%s: not a Lifx session\n", path);
+    free(session);
+    return 1;
+  }
+  free(session);
+
+  lifx.PrintDevices();
+  printf("Replayed %u records (%u rx, %u tx) covering %u ms in %u us\n", stats.records, stats.rxPackets, stats.txPackets, stats.virtualMsec, stats.realMicros);
+  printf("Replayed instance found %d devices and would have sent %u packets\n", lifx.DeviceCount(), stats.replayTxPackets);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc >= 3 && strcmp(argv[1], "capture") == 0)
+    return Capture(argv[2], (argc >= 4) ? strtoul(argv[3], NULL, 10) : 10);
+
+  if (argc >= 3 && strcmp(argv[1], "replay") == 0)
+  {
+    bool startDiscovery = false;
+    uint16_t tickMsec = 10;
+    for (int i = 3; i < argc; i++)
+    {
+      if (strcmp(argv[i], "--discover") == 0) startDiscovery = true;
+      else tickMsec = strtoul(argv[i], NULL, 10);
+    }
+    return Replay(argv[2], startDiscovery, tickMsec);
+  }
+
+  fprintf(stderr, "usage: %s capture <file> [seconds]\n", argv[0]);
+  fprintf(stderr, "       %s replay <file> [--discover] [tickMsec]\n", argv[0]);
+  return 2;
+}
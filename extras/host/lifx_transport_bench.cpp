@@ -0,0 +1,113 @@
+/************************************************************************/
+/* Transport benchmark for the Lifx library host build.                 */
+/*                                                                      */
+/*   lifx_transport_bench [bulbs] [passes]                              */
+/*                                                                      */
+/* Fills the device table with bulbs at 127.0.0.1 so every command the  */
+/* Lifx instance sends comes back to its own socket over loopback, then */
+/* fans power commands out to them, batched by SetPowerByGroup and one  */
+/* at a time by SetDevicePower.  Reports the sendmmsg and recvmmsg      */
+/* calls per packet measured by GetTransportStats.  Nothing is sent     */
+/* off loopback, begin() holds off rediscovery.  Needs UDP port 56700   */
+/* free.                                                                */
+/************************************************************************/
+#include "Lifx.h"
+
+
+#define BENCH_GROUP "Bench"
+#define BENCH_DRAIN_MSEC 1000
+
+
+static void AddBulbs(Lifx &lifx, int bulbs)
+{
+  //  a StateGroup from each bulb is enough to put it in the table and the group
+  byte packet[sizeof(lifx_header) + sizeof(lifx_payload_device_group)];
+  lifx_header *header = (lifx_header *) packet;
+  lifx_payload_device_group *group = (lifx_payload_device_group *) (packet + sizeof(lifx_header));
+
+  for (int i = 0; i < bulbs; i++)
+  {
+    memset(packet, 0, sizeof(packet));
+    header->type = LIFX_DEVICE_STATEGROUP;
+    header->target[0] = 0xd0;
+    header->target[4] = i >> 8;
+    header->target[5] = i;
+    group->group[0] = 1;
+    strcpy(group->label, BENCH_GROUP);
+    lifx.ReceivedMessage(packet, sizeof(packet), IPAddress(127, 0, 0, 1));
+  }
+}
+
+static void Drain(Lifx &lifx, uint32_t rxPackets)
+{
+  //  services the socket until everything sent has come back or BENCH_DRAIN_MSEC passes
+  lifx_transport_stats stats;
+  unsigned long start = millis();
+
+  do
+  {
+    lifx.loop();
+    lifx.GetTransportStats(&stats);
+  } while (stats.rxPackets < rxPackets && (millis() - start) < BENCH_DRAIN_MSEC);
+}
+
+static void Report(const char *name, const lifx_transport_stats &before, const lifx_transport_stats &after, unsigned long micros, uint32_t commands)
+{
+  uint32_t txPackets = after.txPackets - before.txPackets;
+  uint32_t txCalls = after.txCalls - before.txCalls;
+  uint32_t rxPackets = after.rxPackets - before.rxPackets;
+  uint32_t rxCalls = after.rxCalls - before.rxCalls;
+
+  printf("%-10s tx %6u packets %6u calls %.3f calls/packet, %u dropped | rx %6u packets %6u calls %.3f calls/packet | %lu us\n",
+    name, txPackets, txCalls, txPackets ? (float) txCalls / txPackets : 0.0f, after.txDropped - before.txDropped,
+    rxPackets, rxCalls, rxPackets ? (float) rxCalls / rxPackets : 0.0f, micros);
+  if (txPackets != commands)
+    fprintf(stderr, "%s: %u packets sent for %u commands\n", name, txPackets, commands);
+}
+
+int main(int argc, char *argv[])
+{
+  int bulbs = (argc >= 2) ? atoi(argv[1]) : 100;
+  int passes = (argc >= 3) ? atoi(argv[2]) : 100;
+  lifx_transport_stats before;
+  lifx_transport_stats after;
+  unsigned long start;
+  Lifx lifx;
+
+  if (bulbs < 1 || bulbs > LIFX_MAX_DEVICES || passes < 1)
+  {
+    fprintf(stderr, "usage: %s [bulbs 1..%d] [passes]\n", argv[0], LIFX_MAX_DEVICES);
+    return 2;
+  }
+
+  lifx.begin();
+  AddBulbs(lifx, bulbs);
+  printf("%d bulbs, %d passes, batches of up to %d sent and %d received per call\n", lifx.DeviceCount(), passes, LIFX_TX_BATCH_LEN, LIFX_RX_BATCH_LEN);
+
+  lifx.GetTransportStats(&before);
+  start = micros();
+  for (int i = 0; i < passes; i++)
+  {
+    lifx.SetPowerByGroup((char *) BENCH_GROUP, (i & 1) ? 65535 : 0);
+    Drain(lifx, before.rxPackets + (i + 1) * bulbs);
+  }
+  lifx.GetTransportStats(&after);
+  Report("batched", before, after, micros() - start, passes * bulbs);
+  if (after.rxPackets == before.rxPackets)
+  {
+    fprintf(stderr, "nothing came back, is UDP port %d in use?\n", LIFX_PORT);
+    return 1;
+  }
+
+  lifx.GetTransportStats(&before);
+  start = micros();
+  for (int i = 0; i < passes; i++)
+  {
+    for (int n = 0; n < bulbs; n++)
+      lifx.SetDevicePower(lifx.GetIndexedDevice(n), (i & 1) ? 65535 : 0);
+    Drain(lifx, before.rxPackets + (i + 1) * bulbs);
+  }
+  lifx.GetTransportStats(&after);
+  Report("per-device", before, after, micros() - start, passes * bulbs);
+  return 0;
+}